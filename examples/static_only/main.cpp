@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include "em_persistent_state.h"
+
+// NOTE: build this example and the library defining 'EM_PS_STATIC_ONLY'
+#ifndef EM_PS_STATIC_ONLY
+#error "Define 'EM_PS_STATIC_ONLY' in order to build the static only example"
+#endif
+
+EmPersistentState PS;
+EmPersistentUInt16 intVal = EmPersistentUInt16(PS, "i_v", 16);
+EmPersistentFloat floatVal = EmPersistentFloat(PS, "f_v", 55.3f);
+EmPersistentFixedString<10> textVal = EmPersistentFixedString<10>(PS, "txt", "Hello!");
+EmPersistentValueBase* const psValues[] = { &floatVal, &intVal, &textVal };
+const EmPersistentValueRegistry registry(psValues);
+
+void setup() {
+    // The registry is a static array (i.e. no 'EmPersistentValueList' allocation)
+    PS.Init(registry, false);
+}
+
+int main() {
+    setup();
+
+    // Storing new values to PS
+    textVal = "Got new value!"; // This will be truncated because of max len of 10!
+    intVal = 44;
+
+    // Iterating the stored values without allocating memory
+    EmPersistentValueView view;
+    while (PS.Iterate(view)) {
+        printf("%s: %u bytes\n", view.Id().GetId(), view.Size());
+    }
+    return 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// Host stand-in of the Arduino core used by 'host_tests.cpp' (i.e. only what
+// the library and the EmCore headers are using).
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Flash strings are plain strings on host
+#define F(text) (text)
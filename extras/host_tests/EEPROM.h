@@ -0,0 +1,41 @@
+#pragma once
+
+// Host stand-in of the Arduino EEPROM library used by 'host_tests.cpp': a RAM
+// array erased to 0xFF, counting reads and writes.
+#include <stdint.h>
+#include <string.h>
+
+#ifndef HOST_EEPROM_SIZE
+#define HOST_EEPROM_SIZE 1024
+#endif
+
+class HostEEPROM {
+public:
+    HostEEPROM() : reads(0), writes(0) {
+        Wipe();
+    }
+
+    void Wipe() {
+        memset(mem, 0xFF, sizeof(mem));
+    }
+
+    uint16_t begin() { return 0; }
+    uint16_t end() { return HOST_EEPROM_SIZE; }
+    uint16_t length() { return HOST_EEPROM_SIZE; }
+
+    uint8_t read(int index) {
+        reads++;
+        return mem[index];
+    }
+
+    void write(int index, uint8_t value) {
+        writes++;
+        mem[index] = value;
+    }
+
+    uint8_t mem[HOST_EEPROM_SIZE];
+    unsigned long reads;
+    unsigned long writes;
+};
+
+extern HostEEPROM EEPROM;
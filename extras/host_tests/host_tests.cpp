@@ -0,0 +1,354 @@
+// Host tests of the persistent state. Build and run them from the library root
+// folder, 'EMCORE' being the folder of the 'cabbi/EmCore' dependency (e.g. 
+// '.pio/libdeps/<env>/EmCore' or the Arduino libraries one):
+//
+//   g++ -std=c++11 -Iextras/host_tests -Iinclude -I$EMCORE/src extras/host_tests/host_tests.cpp src/*.cpp -o host_tests
+//   ./host_tests
+//
+// 'Arduino.h' and 'EEPROM.h' are host stand-ins found in this folder. Every 
+// configuration must pass, i.e. build and run them again adding:
+//   -DEM_PS_WCET                                   (deferred writes, see 'flush')
+//   -DEM_PS_STATIC_ONLY                            (no heap allocations)
+//   -DEM_PS_TREE_PAGE_SIZE=25                      (deeper trees)
+//   -DEM_PS_SEGMENT_SIZE=64 -DEM_PS_WRITE_ALIGN=4  (segments, aligned records)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "em_persistent_state.h"
+
+HostEEPROM EEPROM;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+// Write the values changes deferred by 'EM_PS_WCET' mode
+static void flush(EmPersistentState& ps) {
+#ifdef EM_PS_WCET
+    ps.Flush();
+#else
+    (void)ps;
+#endif
+}
+
+// A RAM media simulating a reset (i.e. a thrown exception) at a write count
+class ResetMedia: public EmPersistentMedia {
+public:
+    ResetMedia() : writes(0), resetAt(0) {
+        memset(mem, 0xFF, sizeof(mem));
+    }
+    virtual ps_address_t Begin() const { return 0; }
+    virtual ps_address_t End() const { return sizeof(mem); }
+    virtual uint8_t Read(ps_address_t index) const { return mem[index]; }
+    virtual void Write(ps_address_t index, uint8_t byte) {
+        if (0 != resetAt && writes >= resetAt) {
+            throw 0;
+        }
+        writes++;
+        mem[index] = byte;
+    }
+
+    uint8_t mem[1024];
+    unsigned long writes;
+    unsigned long resetAt;
+};
+
+// A RAM flash media (i.e. writes only clear bits, erase sets them)
+class FlashMedia: public EmPersistentMedia {
+public:
+    FlashMedia() : erases(0) {
+        memset(mem, 0x5A, sizeof(mem));
+    }
+    virtual ps_address_t Begin() const { return 0; }
+    virtual ps_address_t End() const { return sizeof(mem); }
+    virtual uint8_t Read(ps_address_t index) const { return mem[index]; }
+    virtual void Write(ps_address_t index, uint8_t byte) { mem[index] &= byte; }
+    virtual bool IsFlash() const { return true; }
+    virtual bool Erase(ps_address_t begin, ps_address_t end) {
+        erases++;
+        memset(mem + begin, 0xFF, (size_t)(end - begin));
+        return true;
+    }
+
+    uint8_t mem[512];
+    int erases;
+};
+
+static void testInitCompaction() {
+    EEPROM.Wipe();
+    {
+        EmPersistentState PS(EmLogLevel::error);
+        EmPersistentUInt16 a(PS, "a", 1);
+        EmPersistentUInt32 b(PS, "b", 2);
+        EmPersistentFixedString<10> c(PS, "c", "three");
+        EmPersistentValueBase* const values[] = { &a, &b, &c };
+        CHECK(PS.Init(EmPersistentValueRegistry(values), false) == 0 && PS.Count() == 3);
+        a = 10;
+        CHECK(PS.Reserve(16));
+    }
+    // Unused values are removed, the reserved space is kept
+    EmPersistentState PS(EmLogLevel::error);
+    EmPersistentFixedString<10> c(PS, "c", "");
+    EmPersistentUInt16 a(PS, "a", 0);
+    EmPersistentValueBase* const values[] = { &c, &a };
+    CHECK(PS.Init(EmPersistentValueRegistry(values), true) == 3);
+    CHECK(PS.Count() == 2 && (uint16_t)a == 10 && strcmp((const char*)c, "three") == 0);
+    EmPersistentStats stats;
+    CHECK(PS.Stats(stats) && stats.values == 2 && stats.deletedBytes == 0);
+    EmPersistentState PS2(EmLogLevel::error);
+    EmPersistentUInt16 a2(PS2, "a", 0);
+    CHECK(PS2.Init() == 2 && PS2.Find(a2) && (uint16_t)a2 == 10);
+}
+
+static const uint16_t c_PortDefault = 1883;
+
+static void testFactoryReset() {
+    EEPROM.Wipe();
+    EmPersistentState PS(EmLogLevel::error);
+    EmPersistentDefaultValue<uint16_t> port(PS, "prt", &c_PortDefault);
+    EmPersistentUInt8 mode(PS, "mod", 1);
+    EmPersistentValueBase* const values[] = { &port, &mode };
+    EmPersistentValueRegistry registry(values);
+    CHECK(PS.Init(registry, false) == 0 && !port.IsStored());
+    EmPersistentMap<uint16_t, uint16_t, 4> map(PS, "map");
+    CHECK(map.Open() && map.Put(1, 2));
+    port = 8883;
+    mode = 2;
+    flush(PS);
+    // Only the defaulted values are reset, other records are kept
+    CHECK(PS.FactoryReset(registry) && (uint16_t)port == 1883 && !port.IsStored());
+    uint16_t value = 0;
+    CHECK((uint8_t)mode == 2 && map.Get(1, value) && 2 == value);
+    EmPersistentState PS2(EmLogLevel::error);
+    EmPersistentDefaultValue<uint16_t> port2(PS2, "prt", &c_PortDefault);
+    EmPersistentUInt8 mode2(PS2, "mod", 0);
+    CHECK(PS2.Init() == 1 && !PS2.Find(port2) && PS2.Find(mode2) && (uint8_t)mode2 == 2);
+}
+
+static void testFlashMoves() {
+    FlashMedia flash;
+    EmPersistentState PS(flash, EmLogLevel::error);
+    EmPersistentUInt8 flags(PS, "flg", 0xFF);
+    EmPersistentUInt16 counter(PS, "cnt", 5);
+    EmPersistentValueBase* const values[] = { &flags, &counter };
+    EmPersistentValueRegistry registry(values);
+    CHECK(PS.Init(registry, false) == 0 && flash.erases == 1);
+    // Clearing bits is done in place, setting them moves the value
+    const ps_address_t address = flags.Address();
+    flags = 0x7F;
+    flush(PS);
+    CHECK(flags.Address() == address);
+    flags = 0xFF;
+    flush(PS);
+    CHECK(flags.Address() != address && flags.IsStored());
+    EmPersistentStats stats;
+    CHECK(PS.Stats(stats) && stats.values == 2 && stats.deletedBytes == EmPersistentLayout::RecordSize(1));
+    // Compaction erases the deleted records
+    CHECK(PS.Init(registry, true) == 2);
+    CHECK(PS.Stats(stats) && stats.deletedBytes == 0 && flash.erases == 2);
+    EmPersistentUInt8 flags2(PS, "flg", 0);
+    CHECK(PS.Find(flags2) && (uint8_t)flags2 == 0xFF);
+}
+
+static void testSlackSameId() {
+    EEPROM.Wipe();
+    // Same id and another size is another value (i.e. not grown in place
+    // unless added with 'replace' set)
+    {
+        EmPersistentState PS(EmLogLevel::error);
+        EmPersistentUInt16 a(PS, "abc", 0x1111);
+        CHECK(PS.Init() == 0 && PS.Add(a) && PS.Reserve(16));
+        EmPersistentUInt32 b(PS, "abc", 0x22222222UL);
+        CHECK(PS.Add(b));
+        a = 0x3333;
+    }
+    {
+        EmPersistentState PS(EmLogLevel::error);
+        EmPersistentUInt16 a(PS, "abc", 0);
+        EmPersistentUInt32 b(PS, "abc", 0);
+        CHECK(PS.Init() == 2 && PS.Find(a) && PS.Find(b));
+        CHECK((uint16_t)a == 0x3333 && (uint32_t)b == 0x22222222UL);
+    }
+#ifndef EM_PS_WCET
+    // A replaced value grows in place (i.e. not in WCET mode)
+    EmPersistentState PS(EmLogLevel::error);
+    EmPersistentFixedString<8> s(PS, "abc", "longer");
+    CHECK(PS.Init() == 2 && PS.Add(s, 0, true) && s.IsStored());
+    EmPersistentStats stats;
+    CHECK(PS.Stats(stats) && stats.values == 2 && stats.slackBytes < 16);
+#endif
+}
+
+struct SensorCfg {
+    int16_t offset;
+    uint8_t gain;
+};
+
+static void testMapRehash() {
+    ResetMedia media;
+    EmPersistentState PS(media, EmLogLevel::none);
+    EmPersistentMap<uint16_t, SensorCfg, 16> map(PS, "map");
+    CHECK(PS.Init() == 0 && map.Open());
+    // A table size exceeding 16 bits is not truncated
+    EmPersistentMap<uint32_t, uint32_t, 7300> big(PS, "big");
+    CHECK(!big.Open());
+    for (uint16_t key=0; key < 15; key++) {
+        SensorCfg cfg = { (int16_t)-key, (uint8_t)key };
+        CHECK(map.Put((uint16_t)(key*8), cfg));
+    }
+    for (uint16_t key=0; key < 3; key++) {
+        CHECK(map.Erase((uint16_t)(key*8)));
+    }
+    CHECK(map.Rehash() && map.Count() == 12);
+    SensorCfg cfg;
+    CHECK(map.Get(3*8, cfg) && cfg.gain == 3 && !map.Get(0, cfg));
+    for (uint16_t key=0; key < 3; key++) {
+        CHECK(map.Erase((uint16_t)((key+3)*8)));
+    }
+    // A reset at any rehash write: the next 'Open' finishes it (i.e. consistent
+    // probe sequences, at most two entries lost)
+    uint8_t snapshot[sizeof(media.mem)];
+    memcpy(snapshot, media.mem, sizeof(snapshot));
+    for (unsigned long reset=1; reset < 120; reset++) {
+        memcpy(media.mem, snapshot, sizeof(snapshot));
+        CHECK(map.Open());
+        media.resetAt = media.writes + reset;
+        bool stopped = false;
+        try {
+            map.Rehash();
+        } catch (int) {
+            stopped = true;
+        }
+        media.resetAt = 0;
+        EmPersistentState PS2(media, EmLogLevel::none);
+        EmPersistentMap<uint16_t, SensorCfg, 16> map2(PS2, "map");
+        CHECK(PS2.Init() == 0 && map2.Open());
+        uint16_t found = 0;
+        for (uint16_t key=6; key < 15; key++) {
+            if (map2.Get((uint16_t)(key*8), cfg) && cfg.gain == key) {
+                found++;
+            }
+        }
+        CHECK(found == map2.Count() && found + 2 >= 9 && (stopped || 9 == found));
+    }
+}
+
+static void testSeriesDrop() {
+    EEPROM.Wipe();
+    EmPersistentState PS(EmLogLevel::none);
+    EmPersistentSeries<int16_t, 64, 8> temps(PS, "tmp");
+    CHECK(PS.Init() == 0 && temps.Open());
+    // A keyframes table exceeding 16 bits is not truncated
+    EmPersistentSeries<int16_t, 30000, 1> big(PS, "big");
+    CHECK(!big.Open());
+    // Oldest keyframes blocks are dropped
+    for (int i=0; i < 200; i++) {
+        CHECK(temps.Append((int16_t)-i));
+    }
+    CHECK(temps.Count() < 200 && 0 == temps.Count() % 8);
+    int16_t sample = 0;
+    CHECK(temps.Last(sample) && -199 == sample);
+    CHECK(temps.Read((uint16_t)(temps.Count()-1), &sample, 1) && -199 == sample);
+    // The kept last block may still leave no room for a sample
+    EmPersistentSeries<uint32_t, 19, 4> wide(PS, "wid");
+    EmPersistentUInt32 after(PS, "aft", 0x12345678UL);
+    CHECK(wide.Open() && PS.Add(after));
+    for (int i=0; i < 4; i++) {
+        CHECK(wide.Append(0));
+    }
+    CHECK(wide.Append(0x40000000UL) && wide.Append(0) && wide.Append(0x40000000UL));
+    CHECK(!wide.Append(0) && wide.Count() == 3);
+    EmPersistentUInt32 after2(PS, "aft", 0);
+    CHECK(PS.Find(after2) && (uint32_t)after2 == 0x12345678UL);
+}
+
+// Values stored out of ids order, an index opened, then a compaction reordering
+// them at the same PS end (i.e. the index must be rebuilt)
+template<typename Index>
+static void testIndex(const char* name) {
+    EEPROM.Wipe();
+    {
+        EmPersistentState PS(EmLogLevel::error);
+        CHECK(PS.Init() == 0);
+        char id[4] = "v00";
+        for (int i=0; i < 20; i++) {
+            const int n = (i * 7) % 20;
+            id[1] = (char)('0' + n / 10);
+            id[2] = (char)('0' + n % 10);
+            EmPersistentUInt16 value(PS, id, (uint16_t)n);
+            CHECK(PS.Add(value));
+        }
+        Index index(PS, "idx");
+        CHECK(index.Open() && index.IsComplete());
+        EmPersistentUInt16 value(PS, "v17", 0);
+        CHECK(PS.Find(value) && (uint16_t)value == 17);
+        EmPersistentUInt16 added(PS, "new", 5);
+        CHECK(PS.Add(added));
+        EmPersistentUInt16 missing(PS, "zzz", 0);
+        CHECK(!PS.Find(missing));
+    }
+    {
+        // Reopened without changes
+        EmPersistentState PS(EmLogLevel::error);
+        CHECK(PS.Init() == 21);
+        Index index(PS, "idx");
+        CHECK(index.Open() && index.IsComplete());
+        EmPersistentUInt16 added(PS, "new", 0);
+        CHECK(PS.Find(added) && (uint16_t)added == 5);
+    }
+    EEPROM.Wipe();
+    {
+        EmPersistentState PS(EmLogLevel::error);
+        CHECK(PS.Init() == 0);
+        EmPersistentUInt16 a(PS, "aaa", 1), b(PS, "bbb", 2), c(PS, "ccc", 3), d(PS, "ddd", 4);
+        CHECK(PS.Add(a) && PS.Add(b) && PS.Add(c) && PS.Add(d));
+        Index index(PS, "idx");
+        CHECK(index.Open());
+    }
+    EmPersistentState PS(EmLogLevel::error);
+    EmPersistentUInt16 c(PS, "ccc", 0), b(PS, "bbb", 0), a(PS, "aaa", 0), e(PS, "eee", 5);
+    EmPersistentValueBase* const values[] = { &c, &b, &a, &e };
+    CHECK(PS.Init(EmPersistentValueRegistry(values), true) >= 0 && PS.Count() == 4);
+    Index index(PS, "idx");
+    CHECK(index.Open() && index.IsComplete());
+    EmPersistentUInt16 c2(PS, "ccc", 0), e2(PS, "eee", 0);
+    CHECK(PS.Find(c2) && (uint16_t)c2 == 3 && PS.Find(e2) && (uint16_t)e2 == 5);
+    EmPersistentValueView view;
+    int count = 0;
+    while (PS.Iterate(view, "aaa", "eee")) {
+        count++;
+    }
+    CHECK(count == 4);
+    printf("%s OK\n", name);
+}
+
+class HashIndex: public EmPersistentHashIndex {
+public:
+    HashIndex(EmPersistentState& ps, const EmPersistentId& id)
+     : EmPersistentHashIndex(ps, id, 64) {
+    }
+};
+
+int main() {
+    testInitCompaction();
+    printf("Init & compaction OK\n");
+    testFactoryReset();
+    printf("Factory reset OK\n");
+    testFlashMoves();
+    printf("Flash moves OK\n");
+    testSlackSameId();
+    printf("Slack same id OK\n");
+    testMapRehash();
+    printf("Map rehash OK\n");
+    testSeriesDrop();
+    printf("Series drop OK\n");
+    testIndex<HashIndex>("Hash index");
+    testIndex<EmPersistentTreeIndex<EM_PS_TREE_PAGE_SIZE < 32 ? 24 : 8> >("Tree index");
+    printf("ALL TESTS PASSED\n");
+    return 0;
+}
@@ -0,0 +1,115 @@
+// Host benchmark of the compressed values LZ codec (see 'EmPersistentLz').
+// Reports the compression ratio and the encode & decode speed of representative
+// payloads. Build and run from the library root folder:
+//
+//   g++ -O2 -std=c++11 -Iinclude extras/lz_benchmark/lz_benchmark.cpp src/em_persistent_lz.cpp -o lz_benchmark
+//   ./lz_benchmark
+//
+// Define 'EM_PS_LZ_WINDOW' (e.g. -DEM_PS_LZ_WINDOW=64) to compare window sizes.
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "em_persistent_lz.h"
+
+struct Payload {
+    const char* name;
+    uint8_t data[2048];
+    uint16_t size;
+};
+
+static void makeJson(Payload& p) {
+    const char* json = 
+        "{\"wifi\":{\"ssid\":\"home-network\",\"mode\":\"station\",\"dhcp\":true,"
+        "\"ip\":\"192.168.1.50\",\"mask\":\"255.255.255.0\",\"gateway\":\"192.168.1.1\"},"
+        "\"mqtt\":{\"host\":\"broker.local\",\"port\":1883,\"topic\":\"home/sensors/kitchen\","
+        "\"qos\":1,\"retain\":false,\"keepalive\":60},"
+        "\"sensors\":[{\"id\":1,\"type\":\"temperature\",\"unit\":\"C\",\"offset\":0,\"period\":60},"
+        "{\"id\":2,\"type\":\"humidity\",\"unit\":\"%\",\"offset\":0,\"period\":60},"
+        "{\"id\":3,\"type\":\"pressure\",\"unit\":\"hPa\",\"offset\":0,\"period\":300},"
+        "{\"id\":4,\"type\":\"temperature\",\"unit\":\"C\",\"offset\":-1,\"period\":60}],"
+        "\"modes\":[\"auto\",\"manual\",\"off\"],\"mode\":\"auto\"}";
+    p.name = "json config";
+    p.size = (uint16_t)strlen(json);
+    memcpy(p.data, json, p.size);
+}
+
+static void makeText(Payload& p) {
+    const char* text = 
+        "Error 12: sensor not responding. Error 13: sensor value out of range. "
+        "Error 14: sensor calibration missing. Warning 21: battery low. "
+        "Warning 22: battery critical. Warning 23: battery not charging. "
+        "Info 31: network connected. Info 32: network disconnected. "
+        "Info 33: firmware update available. Info 34: firmware updated.";
+    p.name = "messages";
+    p.size = (uint16_t)strlen(text);
+    memcpy(p.data, text, p.size);
+}
+
+static void makeSineTable(Payload& p) {
+    p.name = "sine table u8";
+    p.size = 256;
+    for (int i=0; i < 256; i++) {
+        p.data[i] = (uint8_t)(127.5 + 127.5*sin(2*M_PI*i/256));
+    }
+}
+
+static void makeCalibrationTable(Payload& p) {
+    // Piecewise linear curve with repeated steps (e.g. NTC lookup)
+    p.name = "calib table i16";
+    p.size = 512;
+    int16_t* table = (int16_t*)p.data;
+    for (int i=0; i < 256; i++) {
+        table[i] = (int16_t)(i < 128 ? (i / 4) * 10 : 320 + ((i - 128) / 8) * 5);
+    }
+}
+
+static void makeRandom(Payload& p) {
+    p.name = "random";
+    p.size = 256;
+    uint32_t x = 12345;
+    for (int i=0; i < 256; i++) {
+        x = x * 1103515245U + 12345U;
+        p.data[i] = (uint8_t)(x >> 16);
+    }
+}
+
+int main() {
+    static Payload payloads[5];
+    makeJson(payloads[0]);
+    makeText(payloads[1]);
+    makeSineTable(payloads[2]);
+    makeCalibrationTable(payloads[3]);
+    makeRandom(payloads[4]);
+
+    printf("LZ window: %u bytes\n", (unsigned)EmPersistentLz::c_Window);
+    printf("%-16s %6s %8s %7s %12s %12s\n", "payload", "size", "encoded", "ratio", "enc MB/s", "dec MB/s");
+    for (Payload& p: payloads) {
+        static uint8_t encoded[4096];
+        static uint8_t decoded[4096];
+        uint16_t encodedSize = 0;
+        uint16_t decodedSize = 0;
+        if (!EmPersistentLz::Encode(p.data, p.size, encoded, sizeof(encoded), encodedSize) ||
+            !EmPersistentLz::Decode(encoded, encodedSize, decoded, sizeof(decoded), decodedSize) ||
+            decodedSize != p.size || 0 != memcmp(decoded, p.data, p.size)) {
+            printf("%-16s round trip FAILED\n", p.name);
+            return 1;
+        }
+        const int iterations = 2000;
+        auto start = std::chrono::steady_clock::now();
+        for (int i=0; i < iterations; i++) {
+            EmPersistentLz::Encode(p.data, p.size, encoded, sizeof(encoded), encodedSize);
+        }
+        const double encSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        for (int i=0; i < iterations; i++) {
+            EmPersistentLz::Decode(encoded, encodedSize, decoded, sizeof(decoded), decodedSize);
+        }
+        const double decSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const double megaBytes = (double)p.size * iterations / 1e6;
+        printf("%-16s %6u %8u %6.2fx %12.1f %12.1f\n", p.name, (unsigned)p.size, (unsigned)encodedSize,
+               (double)p.size / encodedSize, megaBytes / encSeconds, megaBytes / decSeconds);
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// The LZ codec back references window in bytes (i.e. max 4096), a larger window
+// finds more matches but encoding searches it for each input byte.
+// NOTE: decoding any window size is supported, encoding window only affects speed & ratio.
+#ifndef EM_PS_LZ_WINDOW
+#define EM_PS_LZ_WINDOW 256
+#endif
+
+/***
+    A small window LZ codec (LZSS like) used by compressed values 
+    (see 'EmPersistentCompressed'). It has no dependency and no RAM buffer
+    other than caller input & output, bytes are encoded and decoded in a 
+    single pass (i.e. the window is the already processed data).
+
+    Encoded format: a flags byte followed by 8 items, each flag bit (LSB first)
+    marking a back reference (2 bytes: 12 bits distance-1, 4 bits length-3, 
+    length nibble 0x0F is followed by a length-18 byte) or a literal byte.
+***/
+class EmPersistentLz {
+public:
+    const static uint16_t c_Window = EM_PS_LZ_WINDOW;
+    const static uint16_t c_MinMatch = 3;
+    // Matches from 'c_ExtendedMatch' bytes have a length extension byte
+    const static uint16_t c_ExtendedMatch = 18;
+    const static uint16_t c_MaxMatch = c_ExtendedMatch + 255;
+    static_assert(c_Window > 0 && c_Window <= 4096, "LZ window must be within [1, 4096]");
+
+    // The worst case encoded size of 'size' bytes (i.e. all literals)
+    static constexpr uint16_t MaxEncodedSize(uint16_t size) {
+        return (uint16_t)(size + (size + 7) / 8);
+    }
+
+    // Encode 'size' bytes of 'src' into 'dst' which is 'dstSize' bytes long.
+    // If 'dst' is NULL the encoded size is computed only.
+    // Return false if encoded data doesn't fit 'dstSize'.
+    static bool Encode(const uint8_t* src, 
+                       uint16_t size, 
+                       uint8_t* dst, 
+                       uint16_t dstSize,
+                       uint16_t& encodedSize);
+
+    // Decode 'size' bytes of 'src' into 'dst' which is 'dstSize' bytes long.
+    // Return false if data is corrupted or decoded data doesn't fit 'dstSize'.
+    static bool Decode(const uint8_t* src, 
+                       uint16_t size, 
+                       uint8_t* dst, 
+                       uint16_t dstSize,
+                       uint16_t& decodedSize);
+};
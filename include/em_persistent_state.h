@@ -11,18 +11,160 @@
 #include "em_list.h"
 #include "em_sync_value.h"
 
+#include "em_persistent_lz.h"
+
+// Define 'EM_PS_WCET' for bounded worst case execution time of 'Find', 'Add' 
+// and values 'SetValue' (see 'EmPersistentState::Process'):
+//  - stored values are found by a fixed size RAM index (i.e. no chain scan)
+//  - values changes are written by 'Process' in chunks of bounded size
+//  - public calls exceeding 'EM_PS_WCET_MAX_ACCESSES' storage accesses fail
+#ifdef EM_PS_WCET
+#ifndef EM_PS_WCET_INDEX_SIZE
+#define EM_PS_WCET_INDEX_SIZE 32
+#endif
+#ifndef EM_PS_WCET_QUEUE_SIZE
+#define EM_PS_WCET_QUEUE_SIZE 8
+#endif
+#ifndef EM_PS_WCET_CHUNK_SIZE
+#define EM_PS_WCET_CHUNK_SIZE 8
+#endif
+#ifndef EM_PS_WCET_MAX_ACCESSES
+#define EM_PS_WCET_MAX_ACCESSES 64
+#endif
+#endif
+
+// Define 'EM_PS_DEFAULTS_PROGMEM' when 'EmPersistentDefaultValue' defaults 
+// are stored into AVR program memory (i.e. 'PROGMEM' tables).
+#ifdef EM_PS_DEFAULTS_PROGMEM
+#include <avr/pgmspace.h>
+#define EM_PS_READ_DEFAULT(pDest, pDefault, size) memcpy_P(pDest, pDefault, size)
+#else
+#define EM_PS_READ_DEFAULT(pDest, pDefault, size) memcpy(pDest, pDefault, size)
+#endif
+
+// Define 'EM_PS_STATIC_ONLY' in order to build the library without any dynamic 
+// memory allocation: values are using inline buffers, stored values are iterated
+// by 'EmPersistentValueView' and registered by caller provided static arrays.
+// NOTE: all methods requiring heap memory are not available (i.e. fail to compile).
+
+// Marks the API kept for 1.0.x code only (i.e. a compiler warning)
+#ifdef __GNUC__
+#define EM_PS_DEPRECATED(message) __attribute__((deprecated(message)))
+#else
+#define EM_PS_DEPRECATED(message)
+#endif
+
 // Persistent State types definition
 typedef uint16_t ps_size_t;
 typedef uint16_t ps_address_t;
 
+// Records sizes (i.e. headers and library containers fields) are stored little 
+// endian on every target, so images can be shared across architectures and 
+// parsed by host tools without knowing the device (i.e. no-op on little endian 
+// targets). Values payload is stored as is, see 'EmPersistentSerialized' for 
+// portable payloads.
+// Define 'EM_PS_NATIVE_ENDIAN' to keep the host byte order of images stored by 
+// big endian targets before this format.
+// NOTE: changing it on big endian targets makes already stored values unreadable!
+
+// The media write granularity in bytes (e.g. 4 or 8 for flash emulated EEPROM).
+// Values records (i.e. header and value) are stored at 'EM_PS_WRITE_ALIGN' boundaries 
+// so a value update never shares a media word with another record.
+// NOTE: changing it makes already stored values unreadable!
+#ifndef EM_PS_WRITE_ALIGN
+#define EM_PS_WRITE_ALIGN 1
+#endif
+
+// The segment size in bytes (zero disables segments). A record crossing a 
+// segment start is moved after a segment marker stored at that start (i.e. the
+// gap before it is skipped), so host builds can scan segments in parallel 
+// (see 'ScanSegment').
+// NOTE: must be a multiple of 'EM_PS_WRITE_ALIGN', not supported by flash media.
+#ifndef EM_PS_SEGMENT_SIZE
+#define EM_PS_SEGMENT_SIZE 0
+#endif
+static_assert(0 == EM_PS_SEGMENT_SIZE % EM_PS_WRITE_ALIGN, 
+              "Segment size must be a multiple of the write alignment");
+
 // Forward declaration
 class EmPersistentId;
+class EmPersistentHashedId;
 class EmPersistentState;
 class EmPersistentValueBase;
+class EmPersistentValueView;
+class EmPersistentValueRegistry;
+class EmPersistentNamespace;
+class EmPersistentMapBase;
+class EmPersistentSeriesBase;
+class EmPersistentHeaderMirrorBase;
+class EmPersistentIndex;
+class EmPersistentHashIndex;
+class EmPersistentTreeIndexBase;
+struct EmPersistentStats;
+struct EmPersistentSegmentScan;
+#ifndef EM_PS_STATIC_ONLY
 class EmPersistentValueIterator;
+#endif
 bool _itemsMatch(const EmPersistentValueBase& pv1, 
                  const EmPersistentValueBase& pv2);
 
+#ifndef EM_PS_STATIC_ONLY
+/***
+    The allocator hooks used for every dynamic memory allocation done by the library
+    (i.e. value buffers and persistent values created by 'Load' and 'Iterate').
+
+    Usage example:
+
+        void* poolAlloc(size_t size) { ... }
+        void poolFree(void* ptr) { ... }
+
+        void setup() {
+            // NOTE: hooks can be set only while no library allocation is alive!
+            //       Global persistent values are allocating their buffers at 
+            //       construction time, define 'EM_PS_ALLOC_FUNC' and 'EM_PS_FREE_FUNC'
+            //       in order to use your hooks for them as well.
+            EmPersistentAllocator::Set(poolAlloc, poolFree);
+            ...
+        }
+***/
+#ifndef EM_PS_ALLOC_FUNC
+#define EM_PS_ALLOC_FUNC malloc
+#endif
+#ifndef EM_PS_FREE_FUNC
+#define EM_PS_FREE_FUNC free
+#endif
+
+class EmPersistentAllocator {
+public:
+    typedef void* (*AllocFunc)(size_t size);
+    typedef void (*FreeFunc)(void* ptr);
+
+    // Set the allocation hooks.
+    // Return false if some memory allocated by previous hooks is still in use.
+    static bool Set(AllocFunc allocFunc, FreeFunc freeFunc);
+
+    // Restore the default allocation hooks (i.e. 'EM_PS_ALLOC_FUNC' and 'EM_PS_FREE_FUNC')
+    static bool Reset() {
+        return Set(EM_PS_ALLOC_FUNC, EM_PS_FREE_FUNC);
+    }
+
+    // Allocate 'size' bytes, return NULL if allocation failed
+    static void* Alloc(size_t size);
+
+    // Free memory allocated by 'Alloc'
+    static void Free(void* ptr);
+
+    // The count of allocations not freed yet
+    static uint16_t Allocations() {
+        return s_Allocations;
+    }
+
+private:
+    static AllocFunc s_AllocFunc;
+    static FreeFunc s_FreeFunc;
+    static uint16_t s_Allocations;
+};
+
 /***
     The persistent value list
 ***/
@@ -30,6 +172,181 @@ class EmPersistentValueList: public EmList<EmPersistentValueBase> {
 public:
     EmPersistentValueList() : EmList<EmPersistentValueBase>(_itemsMatch) {}
 };
+#endif // EM_PS_STATIC_ONLY
+
+/***
+    The persistent state storage media, used instead of the default Arduino 'EEPROM'.
+
+    Flash media (i.e. 'IsFlash' returning true) can only clear bits when writing
+    and need an 'Erase' call to set them back. On flash media values are updated 
+    in place when only bits have to be cleared (e.g. flags being cleared), 
+    otherwise the value is moved after the last stored value and the old one
+    is marked as deleted. The whole PS is erased by 'Init' (i.e. first time only)
+    and 'Clear' or when compacted by 'Init(values, true)'.
+***/
+class EmPersistentMedia {
+public:
+    virtual ~EmPersistentMedia() {
+    }
+
+    // The first media address
+    virtual ps_address_t Begin() const = 0;
+
+    // The media address after the last one
+    virtual ps_address_t End() const = 0;
+
+    // Read a byte
+    virtual uint8_t Read(ps_address_t index) const = 0;
+
+    // Write a byte (i.e. flash media are programming 'old & byte')
+    virtual void Write(ps_address_t index, uint8_t byte) = 0;
+
+    // Read 'size' bytes (e.g. external memories overriding it with one bus transaction)
+    virtual void ReadBlock(ps_address_t index, uint8_t* bytes, ps_size_t size) const {
+        for (ps_size_t i=0; i < size; i++) {
+            bytes[i] = Read((ps_address_t)(index+i));
+        }
+    }
+
+    // Checks if write can only clear bits
+    virtual bool IsFlash() const {
+        return false;
+    }
+
+    // Erase the [begin, end) bytes (i.e. set to 0xFF), flash media only.
+    // NOTE: the flash PS range must match the media erase granularity!
+    virtual bool Erase(ps_address_t begin, ps_address_t end) {
+        (void)begin;
+        (void)end;
+        return false;
+    }
+};
+
+/***
+    The media caching 'Pages' pages of 'PageSize' bytes read from another media
+    (e.g. external I2C/SPI EEPROM). A missing page is read ahead from the 
+    requested address in one 'ReadBlock' call, so sequential scans cost one 
+    bus transaction per page instead of one or more per record.
+    Writes go through to the media and update the cached bytes, 'Erase' 
+    invalidates all pages.
+
+    NOTE: call 'Invalidate' if the media is written bypassing this cache.
+
+    Usage example:
+
+        ExternalEeprom eeprom;
+        EmPersistentCachedMedia<2, 32> cachedEeprom(eeprom);
+        EmPersistentState PS(cachedEeprom);
+***/
+template<uint8_t Pages = 2, ps_size_t PageSize = 32>
+class EmPersistentCachedMedia: public EmPersistentMedia {
+public:
+    static_assert(Pages > 0 && PageSize > 0, "Cache without pages");
+
+    EmPersistentCachedMedia(EmPersistentMedia& media)
+    : m_Media(media),
+      m_NextPage(0),
+      m_Fills(0) {
+        Invalidate();
+    }
+
+    virtual ps_address_t Begin() const {
+        return m_Media.Begin();
+    }
+
+    virtual ps_address_t End() const {
+        return m_Media.End();
+    }
+
+    virtual uint8_t Read(ps_address_t index) const {
+        const _Page& page = _page(index);
+        return page.bytes[index - page.address];
+    }
+
+    virtual void ReadBlock(ps_address_t index, uint8_t* bytes, ps_size_t size) const {
+        while (size > 0) {
+            const _Page& page = _page(index);
+            const ps_size_t offset = (ps_size_t)(index - page.address);
+            const ps_size_t count = (ps_size_t)MIN(size, page.size - offset);
+            memcpy(bytes, page.bytes + offset, count);
+            bytes += count;
+            index = (ps_address_t)(index + count);
+            size = (ps_size_t)(size - count);
+        }
+    }
+
+    virtual void Write(ps_address_t index, uint8_t byte) {
+        m_Media.Write(index, byte);
+        // Write through (i.e. pages may overlap)
+        for (uint8_t i=0; i < Pages; i++) {
+            _Page& page = m_Pages[i];
+            if (_contains(page, index)) {
+                uint8_t& cached = page.bytes[index - page.address];
+                cached = m_Media.IsFlash() ? (uint8_t)(cached & byte) : byte;
+            }
+        }
+    }
+
+    virtual bool IsFlash() const {
+        return m_Media.IsFlash();
+    }
+
+    virtual bool Erase(ps_address_t begin, ps_address_t end) {
+        Invalidate();
+        return m_Media.Erase(begin, end);
+    }
+
+    // Drop all cached pages
+    void Invalidate() {
+        for (uint8_t i=0; i < Pages; i++) {
+            m_Pages[i].address = 0;
+            m_Pages[i].size = 0;
+        }
+    }
+
+    // The number of pages read from media (i.e. 'ReadBlock' calls)
+    uint32_t Fills() const {
+        return m_Fills;
+    }
+
+protected:
+    struct _Page {
+        ps_address_t address;
+        ps_size_t size;
+        uint8_t bytes[PageSize];
+    };
+
+    static bool _contains(const _Page& page, ps_address_t index) {
+        return index >= page.address && index - page.address < page.size;
+    }
+
+    // The page holding 'index', read ahead from 'index' if missing
+    const _Page& _page(ps_address_t index) const {
+        for (uint8_t i=0; i < Pages; i++) {
+            if (_contains(m_Pages[i], index)) {
+                return m_Pages[i];
+            }
+        }
+        // Replace pages round robin
+        _Page& page = m_Pages[m_NextPage];
+        m_NextPage = (uint8_t)((m_NextPage + 1) % Pages);
+        const ps_address_t end = m_Media.End();
+        page.address = index;
+        page.size = (ps_size_t)(index < end ? MIN(PageSize, end - index) : 1);
+        if (index < end) {
+            m_Media.ReadBlock(index, page.bytes, page.size);
+        } else {
+            page.bytes[0] = m_Media.Read(index);
+        }
+        m_Fills++;
+        return page;
+    }
+
+    EmPersistentMedia& m_Media;
+    mutable _Page m_Pages[Pages];
+    mutable uint8_t m_NextPage;
+    mutable uint32_t m_Fills;
+};
 
 /***
     The persistent state class stores values identified by a small id (i.e. 3 chars) into EEPROM.
@@ -70,19 +387,63 @@ public:
             
             return 0;
         }
+
+    Static only build (i.e. 'EM_PS_STATIC_ONLY' defined) example:
+
+        EmPersistentState PS;
+        EmPersistentUInt16 intVal = EmPersistentUInt16(PS, "i_v", 16);
+        EmPersistentFixedString<10> textVal = EmPersistentFixedString<10>(PS, "txt", "Hello!");
+        EmPersistentValueBase* const values[] = { &intVal, &textVal };
+        const EmPersistentValueRegistry registry(values);
+
+        void setup() {
+            PS.Init(registry, false);
+        }
 ***/
 class EmPersistentState: public EmLog {
     friend class EmPersistentValueBase;
+    friend class EmPersistentValueView;
     friend class EmPersistentId;
+    friend class EmPersistentNamespace;
+    friend class EmPersistentMapBase;
+    friend class EmPersistentSeriesBase;
+    friend class EmPersistentHeaderMirrorBase;
+    friend class EmPersistentHashIndex;
+    friend class EmPersistentTreeIndexBase;
 public:    
     const static EmPersistentId c_HeaderId; 
     const static EmPersistentId c_FooterId;
+    // The id of values moved somewhere else (flash media only)
+    const static EmPersistentId c_DeletedId;
+    // The id of the erased space after the last value (flash media only)
+    const static EmPersistentId c_ErasedId;
+    // The id of the space reserved for future values (see 'Reserve')
+    const static EmPersistentId c_SlackId;
+    // The id of the namespaces records (see 'EmPersistentNamespace')
+    const static EmPersistentId c_NamespaceId;
+    // The id of the maps records (see 'EmPersistentMap')
+    const static EmPersistentId c_MapId;
+    // The id of the series records (see 'EmPersistentSeries')
+    const static EmPersistentId c_SeriesId;
+    // The id of the segment markers and gaps (see 'EM_PS_SEGMENT_SIZE')
+    const static EmPersistentId c_SegmentId;
+    // The id of the B+tree index records (see 'EmPersistentTreeIndex')
+    const static EmPersistentId c_TreeId;
+    // The id of the hash index records (see 'EmPersistentHashIndex')
+    const static EmPersistentId c_HashIndexId;
     const static int c_MinSize = 12;
 
     EmPersistentState(EmLogLevel logLevel = EmLogLevel::none,
                       ps_address_t beginIndex = EEPROM.begin(),
                       ps_address_t endIndex = EEPROM.end());
 
+    // Persistent state stored into 'media' instead of EEPROM.
+    // NOTE: 'endIndex' set to zero means the media end.
+    EmPersistentState(EmPersistentMedia& media,
+                      EmLogLevel logLevel = EmLogLevel::none,
+                      ps_address_t beginIndex = 0,
+                      ps_address_t endIndex = 0);
+
     // NOTE: keep destructor and class without virtual functions to avoid extra RAM consumption
     ~EmPersistentState() {
     }
@@ -100,18 +461,31 @@ public:
     // has not been successfully initialized.
     //
     // If 'removeUnusedValues' is set to true the storage will remove 
-    // values that are not in the desired 'values' list.
+    // values that are not in the desired 'values' list (i.e. on flash media
+    // it also removes deleted values).
     //
     // NOTE:
     //   appending values to the 'values' list after the 'Init' call has no effect.
     //   Use the persistent state 'Add' method to add values to it.
+#ifndef EM_PS_STATIC_ONLY
     int Init(const EmPersistentValueList& values, bool removeUnusedValues);
+#endif
+
+    // Same as above but 'values' is a registry (i.e. an array of values pointers).
+    // No heap memory is needed and the stored values are scanned only once.
+    int Init(const EmPersistentValueRegistry& values, bool removeUnusedValues);
+
+    // Same as above but 'values' is an array of 'count' values pointers
+    int Init(EmPersistentValueBase* const values[], 
+             uint16_t count, 
+             bool removeUnusedValues);
 
     // Checks if persistent state has been initialized (i.e. 'Init' call!)
     bool IsInitialized() const {
         return _isInitialized(false);
     }
 
+#ifndef EM_PS_STATIC_ONLY
     // Load the current persistent values into a list
     // Return the number of loaded values or -1 if persistent state has not been initialized.
     // NOTE:
@@ -122,17 +496,93 @@ public:
     // NOTE:
     //  This method is dynamically allocating and deallocating heap memory.
     bool Iterate(EmPersistentValueIterator& iterator);
+#endif
+
+    // Iterate the persistent values one by one without allocating memory.
+    // The 'view' is moved to the next stored value, its value can be read by
+    // calling the 'EmPersistentValueView::Read' method.
+    bool Iterate(EmPersistentValueView& view);
+
+    // Same as above but iterating only the values whose id starts with 'prefix'
+    // chars (e.g. "w" for "wif", "wpw", ...). Not matching values headers are 
+    // the only bytes read.
+    // NOTE: 
+    //  hashed ids (see 'EmPersistentHashedId') never match a chars prefix.
+    bool Iterate(EmPersistentValueView& view, const char* prefix);
+
+    // Same as above but iterating only the values whose id is within 
+    // ['first', 'last'] range (i.e. ids chars order, see 'EmPersistentId::OrderKey')
+    // NOTE: 
+    //  values are visited in ids order while a complete 'EmPersistentTreeIndex'
+    //  is attached (i.e. no chain scan), in stored order otherwise.
+    bool Iterate(EmPersistentValueView& view, 
+                 const EmPersistentId& first, 
+                 const EmPersistentId& last);
 
     // Add a value to storage. 
     // This method will check if 'value' is already stored and set its 
     // current value taken from persistent state.
-    bool Add(EmPersistentValueBase& value);
+    // A new value is followed by 'slack' reserved bytes (see 'Reserve') allowing
+    // a later version to grow in place (e.g. a longer string of a new firmware).
+    // Set 'replace' to grow in place the stored version having the same id and
+    // another size (i.e. no other value may use it, it is overwritten).
+    // NOTE (EM_PS_WCET):
+    //  At most '2*(RecordSize(value size)+3)' storage accesses, fails if
+    //  exceeding 'EM_PS_WCET_MAX_ACCESSES'. 'replace' is ignored.
+    bool Add(EmPersistentValueBase& value, ps_size_t slack = 0, bool replace = false);
+
+    // Reserve 'bytes' (i.e. whole records size) at the PS end for future values.
+    // A value whose size changed (i.e. same id) grows in place when it is 
+    // followed by enough reserved space and added with 'replace' set (see 'Add'),
+    // new values are stored into the 
+    // reserved space when the PS end is full. This way planned values additions 
+    // don't need a PS compaction (i.e. 'Init(values, true)' which keeps the 
+    // reserved bytes count).
+    // NOTE:
+    //  Not supported by flash media (i.e. values ids cannot be rewritten).
+    bool Reserve(ps_size_t bytes);
 
     // Find this 'value' identified by its Id and Size.
     // If found the persistent state stored value is set to 'value'.
     // Return true if value has been fond in PS.
+    // NOTE (EM_PS_WCET):
+    //  At most 'value size' storage accesses, fails if exceeding 
+    //  'EM_PS_WCET_MAX_ACCESSES'.
     bool Find(EmPersistentValueBase& value);
 
+#ifdef EM_PS_WCET
+    const static uint16_t c_WcetIndexSize = EM_PS_WCET_INDEX_SIZE;
+    const static uint8_t c_WcetQueueSize = EM_PS_WCET_QUEUE_SIZE;
+    const static ps_size_t c_WcetChunkSize = EM_PS_WCET_CHUNK_SIZE;
+    const static ps_size_t c_WcetMaxAccesses = EM_PS_WCET_MAX_ACCESSES;
+    static_assert(2*c_WcetChunkSize <= c_WcetMaxAccesses, "WCET chunk exceeds max accesses");
+
+    // Write the next chunk of the changed values (i.e. values 'SetValue' calls
+    // are not accessing the storage). Call it periodically (e.g. from a low priority task).
+    // Return false if there is nothing to write or the write failed (i.e. the
+    // value is kept queued, e.g. a flash move needing a compaction).
+    // NOTE:
+    //  At most '2*EM_PS_WCET_CHUNK_SIZE' storage accesses (i.e. read & write), 
+    //  except for flash media values moves which are written as a whole.
+    //  Queued values being destroyed are written as a whole by their destructor
+    //  (i.e. the one not bounded values path, call 'Flush' before if needed).
+    bool Process();
+
+    // Write all the changed values (i.e. not bounded!)
+    void Flush();
+
+    // The count of changed values waiting to be written
+    uint8_t Pending() const {
+        return m_QueueCount;
+    }
+
+    // The storage accesses (i.e. bytes read or written) of the last 
+    // 'Find', 'Add' or 'Process' call
+    uint16_t Accesses() const {
+        return m_Accesses;
+    }
+#endif
+
     // Count the persistent state stored values or -1 if persistent state 
     // has not been initialized.
     // NOTE:
@@ -142,13 +592,100 @@ public:
     // Clear the PS by resetting all its stored values
     bool Clear();
 
+    // Reset the 'values' having a default (see 'EmPersistentDefaultValue') to
+    // it: their records are deleted (i.e. removed by the next compaction) and
+    // they are stored again on their first change. Other values (i.e. without 
+    // a factory value) as well as namespaces, maps, series and indexes are 
+    // not changed.
+    // NOTE:
+    //  Each reset value is looked up (see 'Find').
+    bool FactoryReset(const EmPersistentValueRegistry& values);
+
+    // Get the PS space usage statistics.
+    // Return false if persistent state has not been initialized.
+    // NOTE:
+    //  This method is iterating trough all persistent state stored values.
+    bool Stats(EmPersistentStats& stats);
+
+#if EM_PS_SEGMENT_SIZE > 0
+    // The number of 'EM_PS_SEGMENT_SIZE' segments
+    uint16_t Segments() const;
+
+    // Scan the records of 'segment' up to the next marked one.
+    // Segments can be scanned in parallel (e.g. host threads on a RAM media),
+    // their values summed up and their 'end' checked against the next marked 
+    // segment start (i.e. unmarked segments are scanned by the previous one).
+    // Return false if persistent state has not been initialized.
+    bool ScanSegment(uint16_t segment, EmPersistentSegmentScan& scan) const;
+#endif
+
 protected:   
 
     // Checks if persistent state has been initialized
     bool _isInitialized(bool logError) const;
 
-    // Append a new value to storage
-    bool _appendValue(EmPersistentValueBase* pValue);
+    // Move 'view' to the next value whose id order key is within ['first', 'last']
+    bool _iterate(EmPersistentValueView& view, uint32_t first, uint32_t last);
+
+    // Initialize the persistent state and assign the 'pValues' registry values
+    // (if not NULL) while scanning the stored values.
+    // Return the stored values count or -1 if initialization failed.
+    int _init(const EmPersistentValueRegistry* pValues, uint16_t& foundValues);
+
+    // Set the PS range within the media range
+    void _setRange(ps_address_t mediaBegin, ps_address_t mediaEnd);
+
+    // Write the PS header and footer (i.e. erasing flash media)
+    bool _clear();
+
+    // Append a new value to storage ('replace' see 'Add')
+    bool _appendValue(EmPersistentValueBase* pValue, bool replace = false);
+
+    // Store a new value into the reserved space, either growing its older 
+    // version (i.e. same id, different size, if 'replace' is set) or into the
+    // first fitting slack (unless 'growOnly' is set).
+    // NOTE: it scans the whole records chain, i.e. appends cost a chain scan
+    //       as long as reserved space exists (see 'Reserve').
+    bool _placeInSlack(EmPersistentValueBase* pValue, bool growOnly, bool replace);
+
+    // Update a stored value (i.e. flash media may move it)
+    bool _updateValue(EmPersistentValueBase* pValue);
+
+    // Update 'size' bytes from 'offset' of a stored value 
+    bool _updateValue(EmPersistentValueBase* pValue, ps_size_t offset, ps_size_t size);
+
+#ifdef EM_PS_WCET
+    // Write a stored value (i.e. '_updateValue' is deferring writes)
+    bool _writeValue(EmPersistentValueBase* pValue);
+
+    // Reset index, queue and counters
+    void _wcetReset();
+
+    // Checks if 'accesses' are within the WCET limit
+    bool _wcetCheck(ps_size_t accesses) const;
+
+    // Set the index entry of a stored value
+    bool _indexSet(const EmPersistentId& id, ps_size_t size, ps_address_t address);
+
+    // Remove the index entry of a deleted value
+    void _indexDrop(const EmPersistentId& id, ps_size_t size);
+
+    // Queue a changed value
+    bool _deferValue(EmPersistentValueBase* pValue);
+
+    // Remove the first queued value
+    void _dequeue();
+
+    // Remove a value from the queue (i.e. its changes are dropped)
+    void _cancelValue(const EmPersistentValueBase* pValue);
+
+    // Write a queued value being destroyed, then remove it from the queue
+    void _flushValue(EmPersistentValueBase* pValue);
+#endif
+
+    // Append a new value to storage unless it has its default value 
+    // (see 'EmPersistentDefaultValue') which doesn't need to be stored.
+    bool _appendNotDefault(EmPersistentValueBase* pValue, bool replace = false);
 
     // Performs a check if requested 'index' and 'size' are withint the PS boundaries
     bool _indexCheck(ps_address_t index, ps_size_t size) const;
@@ -167,50 +704,262 @@ protected:
                       const uint8_t* bytes, 
                       ps_size_t size) const;
 
+    // Read a stored size (i.e. little endian unless 'EM_PS_NATIVE_ENDIAN')
+    bool _readSize(ps_address_t index, ps_size_t& size) const;
+
+    // Update a stored size (i.e. little endian unless 'EM_PS_NATIVE_ENDIAN')
+    bool _updateSize(ps_address_t index, ps_size_t size) const;
+
+    // Checks if 'bytes' can be written by clearing bits only
+    bool _canProgram(ps_address_t index, 
+                     const uint8_t* bytes, 
+                     ps_size_t size) const;
+
+    // Checks if PS is stored on a flash media
+    bool _isFlash() const {
+        return NULL != m_pMedia && m_pMedia->IsFlash();
+    }
+
+    // Read a byte from media (no index check)
+    uint8_t _mediaRead(ps_address_t index) const;
+
+    // Write a byte to media (no index check)
+    void _mediaWrite(ps_address_t index, uint8_t byte) const;
+
     // Find the matching id & size
     bool _findMatch(ps_address_t& index, 
                     const EmPersistentId& id, 
                     ps_size_t size) const;
                                    
-    // Read the next PS id and size
+    // Read the record id and size at 'index'.
+    // Return false at the PS end.
+    bool _readRecord(ps_address_t index, 
+                     EmPersistentId& id,
+                     ps_size_t& size) const;
+
+    // Move the namespaces and maps records at the PS beginning (i.e. compaction)
+    // NOTE: index records are dropped, their 'Open' appends and rebuilds them
+    //       (i.e. moved values may leave the indexed PS end unchanged)
+    void _moveContainers();
+
+    // Find the 'recordId' container (i.e. namespace or map) identified by 'id'
+    bool _findContainer(const EmPersistentId& recordId,
+                        const EmPersistentId& id,
+                        ps_address_t& address, 
+                        ps_size_t& size) const;
+
+    // Append a 'recordId' container whose content is 'id' followed by zeros
+    bool _appendContainer(const EmPersistentId& recordId,
+                          const EmPersistentId& id,
+                          ps_size_t size,
+                          ps_address_t& address);
+
+    // Find or append the 'recordId' container identified by 'id' having 
+    // 'contentSize' bytes after the id (i.e. a stored one with a different 
+    // size is deleted). Return the content address or zero if failed (e.g. 
+    // the record doesn't fit the PS range).
+    ps_address_t _openContainer(const EmPersistentId& recordId,
+                                const EmPersistentId& id,
+                                uint32_t contentSize);
+
+    // Checks if a container of 'size' bytes (i.e. id and content) fits the PS
+    // range (i.e. sizes computed wider than 'ps_size_t')
+    bool _containerFits(uint32_t size) const;
+
+    // Checks if 'id' is a container record id (i.e. namespace, map, series or tree)
+    static bool _isContainer(const EmPersistentId& id);
+
+    // Mark the record at 'address' as deleted (i.e. removed by compaction)
+    bool _deleteRecord(ps_address_t address, ps_size_t size);
+
+#if EM_PS_SEGMENT_SIZE > 0
+    // Store the next segment marker if a 'recordSize' bytes record appended
+    // at the PS end would cross the segment start
+    bool _markSegment(ps_size_t recordSize);
+#endif
+
+    // Read the next PS id and size skipping deleted values, reserved space 
+    // and namespaces.
+    // Deleted values bytes are added to 'pDeletedBytes' (if not NULL) and 
+    // reserved bytes to 'pSlackBytes' (if not NULL).
     bool _readNext(ps_address_t& index, 
                    EmPersistentId& id,
-                   ps_size_t& size) const;
+                   ps_size_t& size,
+                   ps_size_t* pDeletedBytes = NULL,
+                   ps_size_t* pSlackBytes = NULL) const;
 
+#ifndef EM_PS_STATIC_ONLY
     // Create a new persistent value reading the next PS item
-    EmPersistentValueBase* _createNext(ps_address_t& index) const;
+    EmPersistentValueBase* _createNext(ps_address_t& index);
+#endif
 
     // The first persistent value address
     ps_address_t _firstPvAddress() const;
+
+    // Add a new stored value to the attached index (if any), 'pValue' is NULL 
+    // for other records appended at the PS end
+    void _indexAppended(const EmPersistentValueBase* pValue);
     
 private:
+    EmPersistentMedia* m_pMedia;
     ps_address_t m_BeginIndex;
     ps_address_t m_EndIndex;
     ps_address_t m_NextPvAddress;
+    // The deleted values bytes (flash media only)
+    ps_size_t m_DeletedBytes;
+    // The reserved bytes (see 'Reserve')
+    ps_size_t m_SlackBytes;
+    // The attached on media index (see 'EmPersistentIndex')
+    EmPersistentIndex* m_pIndex;
+#ifdef EM_PS_WCET
+    struct _IndexEntry {
+        uint32_t key;
+        ps_size_t size;
+        ps_address_t address;
+    };
+    _IndexEntry m_Index[c_WcetIndexSize];
+    uint16_t m_IndexCount;
+    EmPersistentValueBase* m_pQueue[c_WcetQueueSize];
+    uint8_t m_QueueCount;
+    ps_size_t m_QueueOffset;
+    mutable uint16_t m_Accesses;
+#endif
+};
+
+/***
+    The base headers mirror (without template defs!): the stored values headers
+    copied into RAM as structure of arrays (i.e. ids as 32 bits keys, sizes and
+    record addresses), built by one scan. Lookups compare the packed keys using 
+    SSE2/AVX2 when available (i.e. host builds) or a scalar loop.
+    
+    NOTE: the mirror must be rebuilt after values are added or the PS is 
+          compacted, 'Load' fails on records not matching anymore.
+***/
+class EmPersistentHeaderMirrorBase {
+public:
+    // Scan the (initialized) PS, false if not fitting the capacity
+    bool Build();
+
+    // The record address of 'id' & 'size', zero if not found
+    ps_address_t Find(const EmPersistentId& id, ps_size_t size) const;
+
+    // Read the stored value (i.e. same as 'EmPersistentState::Find')
+    bool Load(EmPersistentValueBase& value) const;
+
+    uint16_t Count() const {
+        return m_Count;
+    }
+
+    uint16_t Capacity() const {
+        return m_Capacity;
+    }
+
+    // The index of the first 'key' from 'first', 'count' if not found
+    static uint16_t Search(const uint32_t* keys, 
+                           uint16_t count, 
+                           uint16_t first, 
+                           uint32_t key);
+
+protected:
+    EmPersistentHeaderMirrorBase(EmPersistentState& ps,
+                                 uint32_t* pKeys,
+                                 ps_size_t* pSizes,
+                                 ps_address_t* pAddresses,
+                                 uint16_t capacity);
+
+    EmPersistentState& m_Ps;
+    uint32_t* m_pKeys;
+    ps_size_t* m_pSizes;
+    ps_address_t* m_pAddresses;
+    uint16_t m_Capacity;
+    uint16_t m_Count;
+};
+
+/***
+    The headers mirror of up to 'N' stored values.
+
+    Usage example:
+
+        EmPersistentHeaderMirror<1024> mirror(PS);
+
+        void setup() {
+            PS.Init();
+            mirror.Build();
+            mirror.Load(value);
+        }
+***/
+template<uint16_t N>
+class EmPersistentHeaderMirror: public EmPersistentHeaderMirrorBase {
+public:
+    EmPersistentHeaderMirror(EmPersistentState& ps)
+    : EmPersistentHeaderMirrorBase(ps, m_Keys, m_Sizes, m_Addresses, N) {
+    }
+
+private:
+    uint32_t m_Keys[N];
+    ps_size_t m_Sizes[N];
+    ps_address_t m_Addresses[N];
 };
 
 /***
     A unique ID assigned to a persistent value.
-    The ID MUST be not longer than 'c_MaxLen' chars!
+    The ID is stored as 'c_MaxLen' chars. IDs longer than 'c_MaxLen' chars 
+    (e.g. "net.wifi.ssid") or starting with a non ASCII char are stored as a 
+    hash of the full ID.
+
+    Usage example:
+
+        // Short ID
+        EmPersistentUInt16 intVal = EmPersistentUInt16(PS, "i_v", 16);
+        // Long ID hashed at run time
+        EmPersistentUInt16 portVal = EmPersistentUInt16(PS, "net.mqtt.port", 1883);
+        // Long ID hashed at compile time
+        constexpr EmPersistentHashedId c_SsidId("net.wifi.ssid");
+        EmPersistentFixedString<32> ssidVal = EmPersistentFixedString<32>(PS, c_SsidId, "");
+
+    NOTE: 
+      hashed IDs collisions among the values of an 'EmPersistentValueRegistry' 
+      are logged as warnings by 'EmPersistentState::Init'.
 ***/    
 class EmPersistentId {
     friend class EmPersistentState;
+    friend class EmPersistentNamespace;
+    friend class EmPersistentMapBase;
+    friend class EmPersistentSeriesBase;
     friend class EmPersistentValueBase;
+    friend class EmPersistentValueView;
+    friend class EmPersistentHeaderMirrorBase;
+    friend class EmPersistentHashIndex;
+    friend class EmPersistentTreeIndexBase;
 public:
     const static uint8_t c_MaxLen = 3;
+    // The first char flag marking hashed IDs (i.e. IDs are plain ASCII chars)
+    const static uint8_t c_HashedFlag = 0x80;
 
     EmPersistentId(char a, char b=0, char c=0);
     EmPersistentId(const char* id);
+    EmPersistentId(const EmPersistentHashedId& id);
     EmPersistentId(const EmPersistentId& id);
 
+    // The FNV-1a hash of a (long) ID
+    static constexpr uint32_t Hash(const char* id, uint32_t hash = 2166136261UL) {
+        return 0 == *id ? hash : Hash(id+1, (uint32_t)((hash ^ (uint8_t)*id) * 16777619UL));
+    }
+
+    // The hash folded to the stored ID bits (i.e. 'c_MaxLen' chars without 'c_HashedFlag')
+    static constexpr uint32_t FoldHash(uint32_t hash) {
+        return (hash ^ (hash >> 23)) & 0x7FFFFFUL;
+    }
+
     // NOTE: keep destructor and class without virtual functions to avoid extra RAM consumption
     ~EmPersistentId() {
     }
 
     char operator[](const int index ) const;
     
+    // NOTE: IDs are compared as fixed width integers
     bool operator==(const EmPersistentId& id) const { 
-        return 0 == memcmp(m_Id, id.m_Id, sizeof(m_Id)); 
+        return _key() == id._key(); 
     }
 
     bool operator!=(const EmPersistentId& id) const { 
@@ -224,12 +973,39 @@ public:
     const char* GetId() const {
         return m_Id;
     }
+
+    // Checks if this ID can identify a stored value (i.e. an empty ID is the 
+    // deleted values one and an all 0xFF ID is the flash erased one)
+    bool IsValid() const;
+
+    // Checks if this ID is the hash of a long ID
+    bool IsHashed() const {
+        return 0 != ((uint8_t)m_Id[0] & c_HashedFlag);
+    }
+
+    // The ID as an integer preserving the chars ordering 
+    // (i.e. IDs comparison gives same result as comparing their chars)
+    uint32_t OrderKey() const {
+        return ((uint32_t)(uint8_t)m_Id[0] << 16) | 
+               ((uint32_t)(uint8_t)m_Id[1] << 8) | 
+                (uint32_t)(uint8_t)m_Id[2];
+    }
     
 protected:
     EmPersistentId() {
         memset(m_Id, 0, sizeof(m_Id));
     }
 
+    // The ID as a native integer (i.e. fast comparison only, no ordering!)
+    uint32_t _key() const {
+        uint32_t key;
+        memcpy(&key, m_Id, sizeof(key));
+        return key;
+    }
+
+    // Set this ID from a folded hash
+    void _setHash(uint32_t foldedHash);
+
     // Read this object from PS
     bool _read(const EmPersistentState& ps, ps_address_t index);
 
@@ -238,134 +1014,1947 @@ protected:
 
 private:
     char m_Id[c_MaxLen+1];
+    static_assert(sizeof(uint32_t) == c_MaxLen+1, "ID must fit a 32 bit integer");
 };
 
 /***
-    The base persistent value stored in persistent state (without template defs!)
+    A long ID hashed at compile time (see 'EmPersistentId')
 ***/
-class EmPersistentValueBase {
-    friend class EmPersistentState;
-    friend class EmPersistentValueIterator;
-public:    
-    virtual ~EmPersistentValueBase() {
-        if (NULL != m_pValue) {
-            free(m_pValue);
-        }
-    }
+class EmPersistentHashedId {
+    friend class EmPersistentId;
+public:
+    constexpr EmPersistentHashedId(const char* id)
+     : m_FoldedHash(EmPersistentId::FoldHash(EmPersistentId::Hash(id))) {}
 
-    const EmPersistentId& Id() const {
-        return m_Id;
-    }
+private:
+    uint32_t m_FoldedHash;
+};
 
-    ps_address_t Address() const {
-        return m_Address;
+/***
+    The persistent state records layout:
+
+        [id][size][padding][value][padding]
+
+    The record header (i.e. id & size) and the value start at 'EM_PS_WRITE_ALIGN' 
+    boundaries. With the default alignment of 1 records have no padding.
+***/
+class EmPersistentLayout {
+public:
+    const static ps_size_t c_Align = EM_PS_WRITE_ALIGN;
+    static_assert(c_Align > 0, "EM_PS_WRITE_ALIGN must be greater than zero");
+
+    // The 'size' rounded up to the write granularity
+    static constexpr ps_size_t Aligned(ps_size_t size) {
+        return (ps_size_t)((size + c_Align - 1) / c_Align * c_Align);
     }
 
-    ps_size_t Size() const {
-        return m_BufferSize;
+    // The record header size (i.e. id, size and padding)
+    static constexpr ps_size_t HeaderSize() {
+        return Aligned(EmPersistentId::c_MaxLen + sizeof(ps_size_t));
     }
 
-    bool IsStored() const {
-        return 0 != m_Address;
+    // The whole record size storing a 'valueSize' bytes value
+    static constexpr ps_size_t RecordSize(ps_size_t valueSize) {
+        return (ps_size_t)(HeaderSize() + Aligned(valueSize));
     }
 
-    // Checks if this two persistent values matches (i.e. have same Id and same Size)
-    bool Match(const EmPersistentValueBase& pv) const { 
-        return _match(Id(), pv.Id(), Size(), pv.Size());
+    // The padding bytes of a record storing a 'valueSize' bytes value
+    static constexpr ps_size_t Padding(ps_size_t valueSize) {
+        return (ps_size_t)(RecordSize(valueSize) - valueSize - 
+                           (ps_size_t)(EmPersistentId::c_MaxLen + sizeof(ps_size_t)));
     }
+};
 
-protected:
+/***
+    A namespace is a persistent state stored within its parent persistent state 
+    record (i.e. a contiguous sub-chain of 'capacity' bytes). 
+    The parent values scan skips a whole namespace in one jump, and the namespace
+    values are found, iterated or cleared without reading unrelated records.
+    Namespaces can be nested (i.e. a namespace parent can be a namespace).
 
-    static bool _match(const EmPersistentId& id1,
-                       const EmPersistentId& id2,
-                       ps_size_t size1,
-                       ps_size_t size2) { 
-        return id1 == id2 && size1 == size2; 
-    }
+    Usage example:
 
-    EmPersistentValueBase(const EmPersistentState& ps,
-                          const char* id,
-                          ps_address_t address,
-                          ps_size_t bufferSize,
-                          void* pInitValue = NULL);
+        EmPersistentState PS;
+        EmPersistentNamespace netNs = EmPersistentNamespace(PS, "net", 64);
+        EmPersistentUInt16 portVal = EmPersistentUInt16(netNs, "prt", 1883);
 
-    ps_address_t _idAddress() const {
-        return m_Address;
-    }
+        void setup() {
+            // NOTE: open namespaces after the parent 'Init' (i.e. a parent
+            //       compaction moves them)
+            PS.Init();
+            if (netNs.Open()) {
+                netNs.Init();
+                netNs.Add(portVal);
+            }
+        }
 
-    ps_address_t _sizeAddress() const {
-        return (ps_address_t)(m_Address+EmPersistentId::c_MaxLen);
+    NOTE: 
+      the namespace capacity is set when it is created (i.e. a stored namespace
+      keeps its capacity). Not supported by flash media.
+***/
+class EmPersistentNamespace: public EmPersistentState {
+public:
+    EmPersistentNamespace(EmPersistentState& parent, 
+                          const EmPersistentId& id,
+                          ps_size_t capacity,
+                          EmLogLevel logLevel = EmLogLevel::none);
+
+    // Find the namespace record into the (initialized) parent or append it.
+    // Any 'Init' call fails until the namespace has been opened.
+    bool Open();
+
+    const EmPersistentId& Id() const {
+        return m_Id;
     }
 
-    ps_address_t _valueAddress() const {
-        return (ps_address_t)(m_Address+EmPersistentId::c_MaxLen+
-                             (ps_address_t)sizeof(ps_size_t));
+private:
+    EmPersistentState& m_Parent;
+    EmPersistentId m_Id;
+    ps_size_t m_Capacity;
+};
+
+/***
+    The base persistent map (without template defs!): an open addressed hash 
+    table stored within one record. Each slot is a state byte followed by the
+    key and value bytes, entries are found by linear probing the key hash.
+***/
+class EmPersistentMapBase {
+public:
+    // NOTE: keep destructor and class without virtual functions to avoid extra RAM consumption
+    ~EmPersistentMapBase() {
     }
 
-    ps_address_t _nextPvAddress() const {
-        return (ps_address_t)(m_Address+EmPersistentId::c_MaxLen+
-                              (ps_address_t)sizeof(ps_size_t)+m_BufferSize);
+    // Find the map record into the (initialized) PS or append an empty one.
+    // A stored map having a different slots count or entry size is cleared.
+    bool Open() {
+        return _open(EmPersistentState::c_MapId);
     }
 
-    // Update the value to PS
-    bool _updateValue() const {
-        return m_Ps._updateBytes(_valueAddress(), (const uint8_t*)m_pValue, m_BufferSize);
+    // Remove all the entries
+    bool Clear();
+
+    const EmPersistentId& Id() const {
+        return m_Id;
     }
 
-    virtual EmGetValueResult _getMem(void* pValue) const {
-        EmGetValueResult res = 0 == memcmp(pValue, m_pValue, m_BufferSize) ?
-                               EmGetValueResult::succeedEqualValue :
-                               EmGetValueResult::succeedNotEqualValue;
-        memcpy(pValue, m_pValue, m_BufferSize);
-        return res;
+    // The stored entries count
+    uint16_t Count() const {
+        return m_Used;
     }
 
-    virtual void _setMem(const void* pValue) {
-        memcpy(m_pValue, pValue, m_BufferSize);
+    // The slots count
+    uint16_t Capacity() const {
+        return m_Slots;
+    }
+
+protected:
+    const static uint8_t c_Empty = 0;
+    const static uint8_t c_Used = 1;
+    // The tombstone of an erased entry (i.e. probe sequences go on)
+    const static uint8_t c_Deleted = 2;
+    // An entry to be moved by a rehash
+    const static uint8_t c_Pending = 3;
+
+    EmPersistentMapBase(EmPersistentState& ps, 
+                        const EmPersistentId& id,
+                        uint16_t slots,
+                        ps_size_t keySize,
+                        ps_size_t valueSize);
+
+    // Open the 'recordId' record (i.e. maps and hash indexes)
+    bool _open(const EmPersistentId& recordId);
+
+    bool _isOpen() const {
+        return 0 != m_Address;
+    }
+
+    uint16_t _deleted() const {
+        return m_Deleted;
+    }
+
+    ps_size_t _slotSize() const {
+        return (ps_size_t)(1 + m_KeySize + m_ValueSize);
+    }
+
+    ps_address_t _slotAddress(uint16_t slot) const {
+        return (ps_address_t)(m_Address + slot*_slotSize());
+    }
+
+    bool _get(const void* pKey, void* pValue) const;
+
+    bool _put(const void* pKey, const void* pValue);
+
+    bool _erase(const void* pKey);
+
+    // Rebuild the table in place dropping tombstones ('pEntry' and 'pOther' 
+    // are two slot sized buffers)
+    bool _rehash(uint8_t* pEntry, uint8_t* pOther);
+
+    // Checks if a rehash has not been finished (i.e. some entries are pending)
+    bool _hasPending() const;
+
+    // Find the 'pKey' entry slot, 'freeSlot' is set to the first slot usable 
+    // by a new entry (i.e. 'Capacity()' if none).
+    // Return true if the key has been found.
+    bool _probe(const void* pKey, uint16_t& slot, uint16_t& freeSlot) const;
+
+    // Checks if the 'slot' key is 'pKey'
+    bool _keyMatch(uint16_t slot, const void* pKey) const;
+
+    // The 'pKey' first probe slot
+    uint16_t _hash(const void* pKey) const;
+
+    uint8_t _state(uint16_t slot) const;
+
+    bool _setState(uint16_t slot, uint8_t state);
+
+private:
+    EmPersistentState& m_Ps;
+    EmPersistentId m_Id;
+    // The first slot address (i.e. zero if not opened)
+    ps_address_t m_Address;
+    uint16_t m_Slots;
+    ps_size_t m_KeySize;
+    ps_size_t m_ValueSize;
+    uint16_t m_Used;
+    uint16_t m_Deleted;
+};
+
+/***
+    A persistent map of up to 'N' entries keyed at run time (e.g. per sensor 
+    settings) stored within one record. Get, put and erase are reading and 
+    writing one or two slots at low load factors (i.e. no chain scan).
+
+    Usage example:
+
+        struct SensorCfg { int16_t offset; uint8_t gain; };
+        EmPersistentState PS;
+        EmPersistentMap<uint16_t, SensorCfg, 64> sensors = 
+            EmPersistentMap<uint16_t, SensorCfg, 64>(PS, "sns");
+
+        void setup() {
+            // NOTE: open maps after the PS 'Init' (i.e. a compaction moves them)
+            PS.Init();
+            sensors.Open();
+            sensors.Put(0x1234, SensorCfg{-3, 2});
+            SensorCfg cfg;
+            if (sensors.Get(0x1234, cfg)) {
+                ...
+            }
+        }
+
+    NOTE: 
+      erased entries are left as tombstones, the table is rehashed in place 
+      when they are a quarter of the slots. Not supported by flash media.
+      Keys are hashed and compared by their raw bytes, padding included: use
+      padding free keys (e.g. integers) or zero the key structs before setting
+      their fields (e.g. 'memset').
+***/
+template <typename K, typename V, uint16_t N>
+class EmPersistentMap: public EmPersistentMapBase {
+public:
+    static_assert(N > 0, "Map needs at least one slot");
+    const static ps_size_t c_SlotSize = (ps_size_t)(1 + sizeof(K) + sizeof(V));
+
+    EmPersistentMap(EmPersistentState& ps, const EmPersistentId& id)
+     : EmPersistentMapBase(ps, id, N, sizeof(K), sizeof(V)) {
+    }
+
+    // Same as the base 'Open', a rehash stopped by a reset is done again 
+    // (i.e. moved entries would break probe sequences)
+    bool Open() {
+        if (!EmPersistentMapBase::Open()) {
+            return false;
+        }
+        return !_hasPending() || Rehash();
+    }
+
+    // Get the 'key' value, return false if not found
+    bool Get(const K& key, V& value) const {
+        return _get(&key, &value);
+    }
+
+    // Checks if 'key' is stored
+    bool Contains(const K& key) const {
+        uint16_t slot = 0;
+        uint16_t freeSlot = 0;
+        return _isOpen() && _probe(&key, slot, freeSlot);
+    }
+
+    // Set the 'key' value, return false if map is full
+    bool Put(const K& key, const V& value) {
+        return _put(&key, &value);
+    }
+
+    // Remove the 'key' entry, return false if not found
+    bool Erase(const K& key) {
+        if (!_erase(&key)) {
+            return false;
+        }
+        return 4*_deleted() <= N || Rehash();
+    }
+
+    // Rebuild the table in place dropping the erased entries tombstones.
+    // NOTE: 
+    //  not power loss safe (i.e. up to two entries being moved may be lost), 
+    //  the next 'Open' finishes it.
+    bool Rehash() {
+        uint8_t entry[c_SlotSize];
+        uint8_t other[c_SlotSize];
+        return _rehash(entry, other);
+    }
+};
+
+/***
+    The on media index attached to the PS (see 'EmPersistentHashIndex' and 
+    'EmPersistentTreeIndex'): values lookups are checked against it and 
+    records appended at the PS end are added to it. Ordered indexes are used 
+    by ids ranges iterations as well.
+***/
+class EmPersistentIndex {
+    friend class EmPersistentState;
+public:
+    virtual ~EmPersistentIndex() {
+    }
+
+protected:
+    // Find the 'id' record address, 'complete' is set if a miss is final
+    virtual bool _lookup(const EmPersistentId& id, 
+                         ps_size_t size, 
+                         ps_address_t& address, 
+                         bool& complete) const = 0;
+
+    // Index a value record appended at the PS end
+    virtual bool _insert(const EmPersistentId& id, ps_size_t size, ps_address_t address) = 0;
+
+    // Store the indexed PS end
+    virtual bool _storeEnd() = 0;
+
+    // Find the first record after 'key' and 'size' (ids order, then size) or
+    // matching them if 'inclusive'. 
+    // Return false if not found or the index is not ordered or complete.
+    virtual bool _seek(uint32_t key, 
+                       ps_size_t size, 
+                       bool inclusive,
+                       uint32_t& foundKey,
+                       ps_size_t& foundSize,
+                       ps_address_t& address) const {
+        (void)key;
+        (void)size;
+        (void)inclusive;
+        (void)foundKey;
+        (void)foundSize;
+        (void)address;
+        return false;
+    }
+
+    // Checks if '_seek' visits all stored values (i.e. ranges iterations)
+    virtual bool _isOrdered() const {
+        return false;
+    }
+};
+
+/***
+    An on media hash index of the PS values: an open addressed table (see 
+    'EmPersistentMap') stored within the PS itself and mapping each value id 
+    to its size and record address. Once opened it is attached to the PS, so 
+    'Find' and 'Add' are reading one or two slots and the value record instead
+    of scanning the chain (i.e. no RAM index).
+    The indexed PS end is stored as well: the index is rebuilt by 'Open' if 
+    values were appended while it was not attached. A compaction drops the 
+    index record (i.e. 'Open' appends and rebuilds it).
+
+    Usage example:
+
+        EmPersistentState PS;
+        EmPersistentHashIndex psIndex = EmPersistentHashIndex(PS, "idx", 2048);
+
+        void setup() {
+            // NOTE: open the index after the PS 'Init' (i.e. 'Init' and 'Clear' detach it)
+            PS.Init();
+            psIndex.Open();
+            PS.Add(value);
+        }
+
+    NOTE: 
+      'slots' should be larger than the values count (i.e. a full index falls 
+      back to chain scans). Not supported by flash media.
+***/
+class EmPersistentHashIndex: public EmPersistentMapBase, public EmPersistentIndex {
+    friend class EmPersistentState;
+public:
+    EmPersistentHashIndex(EmPersistentState& ps, 
+                          const EmPersistentId& id,
+                          uint16_t slots);
+
+    // Detach the index from the PS
+    virtual ~EmPersistentHashIndex();
+
+    // Find the index record into the (initialized) PS or append it, rebuild it
+    // if needed and attach it to the PS.
+    bool Open();
+
+    // Rebuild the index scanning the PS values once
+    bool Rebuild();
+
+    // Checks if all stored values are indexed (i.e. lookup misses are not 
+    // scanning the chain)
+    bool IsComplete() const {
+        return m_Complete;
+    }
+
+protected:
+    struct _Entry {
+        ps_size_t size;
+        ps_address_t address;
+    };
+
+    // The key of the indexed PS end entry (i.e. ids keys are 24 bits)
+    const static uint32_t c_EndKey = 0xFFFFFFFFUL;
+    // The stored key and entry sizes (i.e. little endian fields)
+    const static ps_size_t c_KeySize = 4;
+    const static ps_size_t c_EntrySize = 4;
+
+    // Read & write 'key' entry, encoded as little endian fields (i.e. same 
+    // image on every target)
+    bool _getEntry(uint32_t key, _Entry& entry) const;
+    bool _putEntry(uint32_t key, const _Entry& entry);
+
+    static void _encodeKey(uint32_t key, uint8_t* pKey);
+
+    virtual bool _lookup(const EmPersistentId& id, 
+                         ps_size_t size, 
+                         ps_address_t& address, 
+                         bool& complete) const;
+
+    virtual bool _insert(const EmPersistentId& id, ps_size_t size, ps_address_t address);
+
+    virtual bool _storeEnd();
+
+private:
+    EmPersistentState& m_State;
+    bool m_Complete;
+};
+
+// The B+tree index page size in bytes: a flags/count byte followed by 8 bytes
+// entries (i.e. id order key, size and record address or child page).
+// Larger pages are lowering the tree height (i.e. media reads per lookup) and
+// are raising the bytes copied on each insert.
+#ifndef EM_PS_TREE_PAGE_SIZE
+#define EM_PS_TREE_PAGE_SIZE 64
+#endif
+
+/***
+    The base B+tree index (without template defs!): the PS values ordered by id
+    (see 'EmPersistentId::OrderKey') then size, stored within one record as 
+    fixed size pages. Lookups are reading one page per tree level, ids ranges
+    are iterated in order (i.e. 'Iterate(view, first, last)' skips the chain).
+
+    Pages are never updated in place: an insert copies the leaf to root path 
+    into free pages, then stores the new root into the inactive root slot and 
+    flips the slot selector byte (i.e. a power loss keeps the previous tree).
+    Free pages are tracked by a RAM bitmap rebuilt by 'Open' walking the tree.
+    A compaction drops the index record (i.e. 'Open' appends and rebuilds it).
+
+    Record content: root slot selector, two root slots (root page, indexed PS
+    end and entries count) and the pages.
+***/
+class EmPersistentTreeIndexBase: public EmPersistentIndex {
+    friend class EmPersistentState;
+public:
+    // Entries per page (i.e. a full page is split in two halves)
+    const static uint8_t c_PageEntries = (uint8_t)((EM_PS_TREE_PAGE_SIZE - 1) / 8);
+    // The maximum tree height (i.e. leaf to root path pages)
+    const static uint8_t c_MaxHeight = 8;
+    static_assert(c_PageEntries >= 3, "Tree pages need at least three entries");
+    static_assert(c_PageEntries <= 127, "Tree pages have at most 127 entries");
+
+    // Detach the index from the PS
+    virtual ~EmPersistentTreeIndexBase();
+
+    // Find the index record into the (initialized) PS or append it, rebuild it
+    // if needed and attach it to the PS.
+    bool Open();
+
+    // Rebuild the index scanning the PS values once
+    bool Rebuild();
+
+    // Checks if all stored values are indexed (i.e. lookup misses are not 
+    // scanning the chain and ranges are iterated in ids order)
+    bool IsComplete() const {
+        return m_Complete;
+    }
+
+    // The indexed records count
+    uint16_t Count() const {
+        return m_Count;
+    }
+
+    // The pages count
+    uint16_t Pages() const {
+        return m_Pages;
+    }
+
+    // The pages used by the current tree
+    uint16_t UsedPages() const;
+
+    // The tree levels count (zero if empty)
+    uint8_t Height() const;
+
+protected:
+    EmPersistentTreeIndexBase(EmPersistentState& ps, 
+                              const EmPersistentId& id,
+                              uint16_t pages,
+                              uint8_t* pUsed);
+
+    // A page image (i.e. one more entry before it is split)
+    struct _Page {
+        uint8_t bytes[1 + (c_PageEntries + 1) * 8];
+    };
+
+    virtual bool _lookup(const EmPersistentId& id, 
+                         ps_size_t size, 
+                         ps_address_t& address, 
+                         bool& complete) const;
+
+    virtual bool _insert(const EmPersistentId& id, ps_size_t size, ps_address_t address);
+
+    virtual bool _storeEnd();
+
+    virtual bool _seek(uint32_t key, 
+                       ps_size_t size, 
+                       bool inclusive,
+                       uint32_t& foundKey,
+                       ps_size_t& foundSize,
+                       ps_address_t& address) const;
+
+    virtual bool _isOrdered() const {
+        return m_Complete;
+    }
+
+    // Add an entry, an existing one is replaced if 'replace' is set
+    bool _add(uint32_t key, ps_size_t size, ps_address_t address, bool replace);
+
+    // Read the page from root to the leaf where 'key' and 'size' belong, 
+    // 'pPath' and 'pSlots' are set to the pages and the children followed.
+    // Return false if the tree is empty or corrupted.
+    bool _descend(uint32_t key, 
+                  ps_size_t size, 
+                  _Page& page, 
+                  uint16_t* pPath, 
+                  uint8_t* pSlots, 
+                  uint8_t& depth) const;
+
+    // Mark the 'page' subtree pages as used
+    bool _walk(uint16_t page, uint8_t depth);
+
+    // Store a new page image, return false if no page is free
+    bool _storePage(const _Page& page, uint16_t& pageIndex);
+
+    // Store a new page image or two halves if it is full.
+    // NOTE: 'page' is left with the lower half.
+    bool _storeSplit(_Page& page, 
+                     _Page& right, 
+                     uint16_t& leftIndex, 
+                     uint16_t& rightIndex, 
+                     bool& split);
+
+    // Store the root and the indexed PS end into the inactive root slot and 
+    // select it
+    bool _storeRoot(uint16_t root, uint16_t count);
+
+    bool _readPage(uint16_t pageIndex, _Page& page) const;
+    ps_address_t _pageAddress(uint16_t pageIndex) const;
+    bool _isUsed(uint16_t pageIndex) const;
+    void _setUsed(uint16_t pageIndex, bool used);
+
+    // Page image fields
+    static bool _isLeaf(const _Page& page);
+    static uint8_t _count(const _Page& page);
+    static void _setHeader(_Page& page, bool leaf, uint8_t count);
+    static void _getEntry(const _Page& page, 
+                          uint8_t entry, 
+                          uint32_t& key, 
+                          ps_size_t& size, 
+                          uint16_t& value);
+    static void _setEntry(_Page& page, 
+                          uint8_t entry, 
+                          uint32_t key, 
+                          ps_size_t size, 
+                          uint16_t value);
+    static void _insertEntry(_Page& page, 
+                             uint8_t entry, 
+                             uint32_t key, 
+                             ps_size_t size, 
+                             uint16_t value);
+    // Compare the ('key1', 'size1') and ('key2', 'size2') entries
+    static int _compare(uint32_t key1, ps_size_t size1, uint32_t key2, ps_size_t size2);
+
+private:
+    // The no page value (i.e. empty tree)
+    const static uint16_t c_NoPage = 0xFFFF;
+    // The root slot size (i.e. root page, PS end and count)
+    const static ps_size_t c_RootSlotSize = 3 * sizeof(uint16_t);
+    // The pages offset within the record content
+    const static ps_size_t c_PagesOffset = 1 + 2 * c_RootSlotSize;
+
+    EmPersistentState& m_State;
+    EmPersistentId m_Id;
+    ps_address_t m_Address;
+    uint16_t m_Pages;
+    uint8_t* m_pUsed;
+    uint8_t m_Selector;
+    uint16_t m_Root;
+    uint16_t m_Count;
+    bool m_Complete;
+};
+
+/***
+    An on media B+tree index of the PS values having 'N' pages of 
+    'EM_PS_TREE_PAGE_SIZE' bytes (i.e. a RAM bitmap of one bit per page).
+    Once opened it is attached to the PS, so 'Find' and 'Add' are reading one
+    page per tree level and the value record instead of scanning the chain, 
+    and ids ranges are iterated in ids order.
+    Page reads of large host stores can be cached by an 'EmPersistentCachedMedia'
+    (i.e. its pages count and size set the cache RAM).
+
+    Usage example:
+
+        EmPersistentState PS(hostFileMedia);
+        EmPersistentTreeIndex<512> psIndex = EmPersistentTreeIndex<512>(PS, "idx");
+
+        void setup() {
+            // NOTE: open the index after the PS 'Init' (i.e. 'Init' and 'Clear' detach it)
+            PS.Init();
+            psIndex.Open();
+            EmPersistentValueView view;
+            while (PS.Iterate(view, "s00", "s99")) {
+                ...
+            }
+        }
+
+    NOTE: 
+      each insert uses up to twice the tree height free pages until the new 
+      root is stored, a full index falls back to chain scans. Not supported by
+      flash media.
+***/
+template<uint16_t N>
+class EmPersistentTreeIndex: public EmPersistentTreeIndexBase {
+public:
+    static_assert(N >= 4, "Tree index needs at least four pages");
+
+    EmPersistentTreeIndex(EmPersistentState& ps, const EmPersistentId& id)
+     : EmPersistentTreeIndexBase(ps, id, N, m_Used) {
+    }
+
+private:
+    uint8_t m_Used[(N + 7U) / 8U];
+};
+
+/***
+    The base persistent series (without template defs!): integer samples 
+    stored within one record as zigzag varint deltas of the previous sample.
+    Every 'keyInterval' samples a keyframe stores the sample itself and its 
+    data offset is kept in a table, so reading starts at the nearest keyframe.
+
+    Record content: count, used bytes, keyframes offsets table and data bytes.
+***/
+class EmPersistentSeriesBase {
+public:
+    // NOTE: keep destructor and class without virtual functions to avoid extra RAM consumption
+    ~EmPersistentSeriesBase() {
+    }
+
+    // Find the series record into the (initialized) PS or append an empty one.
+    // A stored series having a different capacity is cleared.
+    bool Open();
+
+    // Remove all the samples
+    bool Clear();
+
+    const EmPersistentId& Id() const {
+        return m_Id;
+    }
+
+    // The stored samples count
+    uint16_t Count() const {
+        return m_Count;
+    }
+
+    // The data bytes used by the stored samples
+    ps_size_t UsedBytes() const {
+        return m_Used;
+    }
+
+protected:
+    // The max bytes of a 32 bit varint
+    const static uint8_t c_MaxVarintSize = 5;
+
+    // The decoding position
+    struct _Cursor {
+        // The next sample index
+        uint16_t index;
+        // The next sample data offset
+        ps_size_t offset;
+        // The previous sample
+        uint32_t raw;
+    };
+
+    EmPersistentSeriesBase(EmPersistentState& ps, 
+                           const EmPersistentId& id,
+                           ps_size_t capacity,
+                           uint16_t keyInterval);
+
+    bool _isOpen() const {
+        return 0 != m_Address;
+    }
+
+    // The data offset within the content (i.e. after count, used & keyframes table)
+    // NOTE: wider than 'ps_size_t' (i.e. checked by 'Open')
+    uint32_t _dataOffset() const {
+        return (uint32_t)((2 + m_Capacity/m_KeyInterval + 1)*sizeof(ps_size_t));
+    }
+
+    ps_address_t _dataAddress() const {
+        return (ps_address_t)(m_Address + _dataOffset());
+    }
+
+    // Append a sample (i.e. as 32 bit two's complement)
+    bool _append(uint32_t raw);
+
+    // Drop the oldest samples when data space is full
+    bool _drop();
+
+    // Set 'cursor' to decode the 'index' sample next
+    bool _seek(uint16_t index, _Cursor& cursor) const;
+
+    // Decode the 'cursor' sample and move to the next one
+    bool _decodeNext(_Cursor& cursor, uint32_t& raw) const;
+
+    // The 'block' keyframe data offset
+    ps_size_t _keyframe(uint16_t block) const;
+
+    bool _storeKeyframe(uint16_t block, ps_size_t offset);
+
+    // Store count & used bytes (i.e. commits appended bytes)
+    bool _storeHeader();
+
+    static uint32_t _zigzag(uint32_t value) {
+        return (value << 1) ^ (0U - (value >> 31));
+    }
+
+    static uint32_t _unzigzag(uint32_t value) {
+        return (value >> 1) ^ (0U - (value & 1));
+    }
+
+    // Encode 'value' into 'bytes' (i.e. 'c_MaxVarintSize' long), return the bytes count
+    static uint8_t _varint(uint32_t value, uint8_t* bytes);
+
+    uint32_t _lastRaw() const {
+        return m_LastRaw;
+    }
+
+private:
+    EmPersistentState& m_Ps;
+    EmPersistentId m_Id;
+    // The content address (i.e. zero if not opened)
+    ps_address_t m_Address;
+    ps_size_t m_Capacity;
+    uint16_t m_KeyInterval;
+    uint16_t m_Count;
+    ps_size_t m_Used;
+    uint32_t m_LastRaw;
+};
+
+/***
+    A persistent series of integer samples (e.g. daily energy totals) stored 
+    within one record of 'Capacity' data bytes, slowly changing samples take 
+    about one byte each. Appending writes the new sample bytes and the record
+    header only. When data space is full the oldest samples are dropped.
+
+    Usage example:
+
+        EmPersistentState PS;
+        EmPersistentSeries<int16_t, 128> temps = EmPersistentSeries<int16_t, 128>(PS, "tmp");
+
+        void setup() {
+            // NOTE: open series after the PS 'Init' (i.e. a compaction moves them)
+            PS.Init();
+            temps.Open();
+        }
+
+        void onNewDay(int16_t temp) {
+            temps.Append(temp);
+            // Last week samples
+            int16_t week[7];
+            if (temps.Count() >= 7) {
+                temps.Read(temps.Count()-7, week, 7);
+            }
+        }
+
+    NOTE: 
+      not supported by flash media.
+***/
+template <typename T, ps_size_t Capacity, uint16_t KeyInterval = 16>
+class EmPersistentSeries: public EmPersistentSeriesBase {
+public:
+    static_assert((T)1/(T)2 == 0 && sizeof(T) <= sizeof(uint32_t), 
+                  "Series samples must be integers up to 32 bits");
+    static_assert(KeyInterval > 0, "Keyframes interval must be greater than zero");
+
+    EmPersistentSeries(EmPersistentState& ps, const EmPersistentId& id)
+     : EmPersistentSeriesBase(ps, id, Capacity, KeyInterval) {
+    }
+
+    bool Append(T sample) {
+        return _append((uint32_t)sample);
+    }
+
+    // Read 'count' samples starting from 'first' (i.e. zero is the oldest one)
+    bool Read(uint16_t first, T* pSamples, uint16_t count) const {
+        _Cursor cursor;
+        if (0 == count || !_seek(first, cursor)) {
+            return false;
+        }
+        for (uint16_t i=0; i < count; i++) {
+            uint32_t raw = 0;
+            if (!_decodeNext(cursor, raw)) {
+                return false;
+            }
+            pSamples[i] = (T)raw;
+        }
+        return true;
+    }
+
+    // Get the last appended sample, return false if none
+    bool Last(T& sample) const {
+        if (0 == Count()) {
+            return false;
+        }
+        sample = (T)_lastRaw();
+        return true;
+    }
+};
+
+/***
+    The persistent state space usage statistics (see 'EmPersistentState::Stats')
+***/
+struct EmPersistentStats {
+    // The stored values count
+    uint16_t values;
+    // The bytes used by values
+    ps_size_t valueBytes;
+    // The bytes used by PS header & footer and values id & size
+    ps_size_t headerBytes;
+    // The bytes lost by records alignment (see 'EM_PS_WRITE_ALIGN')
+    ps_size_t paddingBytes;
+    // The bytes used by deleted values (flash media only)
+    ps_size_t deletedBytes;
+    // The bytes reserved for future values (see 'EmPersistentState::Reserve')
+    ps_size_t slackBytes;
+    // The bytes available for new values (i.e. records including their headers)
+    // after the reserved ones
+    ps_size_t freeBytes;
+};
+
+/***
+    The records of a segment (see 'EmPersistentState::ScanSegment')
+***/
+struct EmPersistentSegmentScan {
+    // The segment starts with a marker (i.e. unmarked ones have no records)
+    bool marked;
+    // The stored values count
+    uint16_t values;
+    // The address after the last scanned record (i.e. the next marked segment
+    // start or the PS end)
+    ps_address_t end;
+};
+
+/***
+    The base persistent value stored in persistent state (without template defs!)
+
+    NOTE: 
+      values are appending records to their state (e.g. a default value first
+      change), so they hold a non const state reference. The deprecated const
+      state constructors are kept for 1.0.x code holding a const reference only:
+      the state object itself must not be a const one (i.e. undefined behavior).
+***/
+class EmPersistentValueBase {
+    friend class EmPersistentState;
+    friend class EmPersistentHeaderMirrorBase;
+#ifndef EM_PS_STATIC_ONLY
+    friend class EmPersistentValueIterator;
+#endif
+public:    
+#ifndef EM_PS_STATIC_ONLY
+    virtual ~EmPersistentValueBase() {
+#ifdef EM_PS_WCET
+        m_Ps._flushValue(this);
+#endif
+        EmPersistentAllocator::Free(m_pValue);
+    }
+
+    // Persistent values created on heap are using the library allocator hooks
+    static void* operator new(size_t size) noexcept {
+        return EmPersistentAllocator::Alloc(size);
+    }
+
+    static void operator delete(void* ptr) {
+        EmPersistentAllocator::Free(ptr);
+    }
+#else
+    // NOTE: value buffers are owned by the derived classes (i.e. inline buffers)
+    virtual ~EmPersistentValueBase() {
+#ifdef EM_PS_WCET
+        m_Ps._flushValue(this);
+#endif
+    }
+
+    // Persistent values cannot be created on heap
+    static void* operator new(size_t size) = delete;
+
+    // NOTE: never called but needed by the virtual destructor
+    static void operator delete(void*) {
+    }
+#endif
+
+    const EmPersistentId& Id() const {
+        return m_Id;
+    }
+
+    ps_address_t Address() const {
+        return m_Address;
+    }
+
+    ps_size_t Size() const {
+        return m_BufferSize;
+    }
+
+    bool IsStored() const {
+        return 0 != m_Address;
+    }
+
+    // Checks if this two persistent values matches (i.e. have same Id and same Size)
+    bool Match(const EmPersistentValueBase& pv) const { 
+        return _match(Id(), pv.Id(), Size(), pv.Size());
+    }
+
+    // Compares this persistent value to 'id' & 'size' (i.e. persistent values ordering)
+    // Return zero if matching, a negative value if it comes before and a positive 
+    // value if it comes after.
+    int Compare(const EmPersistentId& id, ps_size_t size) const { 
+        const uint32_t key = m_Id.OrderKey();
+        const uint32_t otherKey = id.OrderKey();
+        if (key != otherKey) {
+            return key < otherKey ? -1 : 1;
+        }
+        return (int)m_BufferSize - (int)size;
+    }
+
+protected:
+
+    static bool _match(const EmPersistentId& id1,
+                       const EmPersistentId& id2,
+                       ps_size_t size1,
+                       ps_size_t size2) { 
+        return id1 == id2 && size1 == size2; 
+    }
+
+    EmPersistentValueBase(EmPersistentState& ps,
+                          const EmPersistentId& id,
+                          ps_address_t address,
+                          ps_size_t bufferSize,
+                          void* pInitValue = NULL);
+
+    ps_address_t _idAddress() const {
+        return m_Address;
+    }
+
+    ps_address_t _sizeAddress() const {
+        return (ps_address_t)(m_Address+EmPersistentId::c_MaxLen);
+    }
+
+    ps_address_t _valueAddress() const {
+        return (ps_address_t)(m_Address+EmPersistentLayout::HeaderSize());
+    }
+
+    ps_address_t _nextPvAddress() const {
+        return (ps_address_t)(m_Address+EmPersistentLayout::RecordSize(m_BufferSize));
+    }
+
+    // Write the value to PS
+    bool _writeValue() const {
+        return m_Ps._updateBytes(_valueAddress(), (const uint8_t*)m_pValue, m_BufferSize);
+    }
+
+    // Read the value from PS (i.e. discarding RAM changes)
+    bool _readValue() {
+        return IsStored() && 
+               m_Ps._readBytes(_valueAddress(), (uint8_t*)m_pValue, m_BufferSize);
+    }
+
+    // Update the value to PS.
+    // Values having a default are stored on their first change.
+    bool _updateValue() {
+        if (IsStored()) {
+            return m_Ps._updateValue(this);
+        }
+        return _hasDefault() && m_Ps._appendNotDefault(this);
+    }
+
+    // Update 'size' value bytes from 'offset' to PS (i.e. other bytes unchanged)
+    bool _updateValue(ps_size_t offset, ps_size_t size) {
+        if (IsStored()) {
+            return m_Ps._updateValue(this, offset, size);
+        }
+        return _hasDefault() && m_Ps._appendNotDefault(this);
+    }
+
+    // Checks if value has a default which is not stored (see 'EmPersistentDefaultValue')
+    virtual bool _hasDefault() const {
+        return false;
+    }
+
+    // Checks if value is set to its default
+    virtual bool _isDefault() const {
+        return false;
+    }
+
+    // Set the value to its default
+    virtual void _setDefault() {
+    }
+
+    virtual EmGetValueResult _getMem(void* pValue) const {
+        EmGetValueResult res = 0 == memcmp(pValue, m_pValue, m_BufferSize) ?
+                               EmGetValueResult::succeedEqualValue :
+                               EmGetValueResult::succeedNotEqualValue;
+        memcpy(pValue, m_pValue, m_BufferSize);
+        return res;
+    }
+
+    virtual void _setMem(const void* pValue) {
+        memcpy(m_pValue, pValue, m_BufferSize);
     }
 
     virtual bool _store() const;
 
-    virtual void _copyFrom(EmPersistentValueBase* pPv) {
-        memcpy(m_pValue, pPv->m_pValue, m_BufferSize);
-        m_Address = pPv->m_Address;
+    virtual void _copyFrom(EmPersistentValueBase* pPv) {
+        memcpy(m_pValue, pPv->m_pValue, m_BufferSize);
+        m_Address = pPv->m_Address;
+    }
+
+protected:
+    EmPersistentState& m_Ps;
+    EmPersistentId m_Id;
+    ps_address_t m_Address;
+    ps_size_t m_BufferSize;
+    void* m_pValue;
+};
+
+inline bool _itemsMatch(const EmPersistentValueBase& pv1, 
+                        const EmPersistentValueBase& pv2) { 
+    // This method is used to see if two items are the same in terms of EEPROM storage
+    return pv1.Match(pv2); 
+}
+
+/***
+    The values memory compare & copy kernels selected at compile time by value size:
+      - 1, 2, 4 and 8 bytes values are compared and copied as a single integer
+      - medium values (i.e. multiple of 4 bytes up to 'c_MaxWordsSize') word by word
+      - other values by 'memcmp' & 'memcpy' (i.e. vectorized by host C libraries)
+    NOTE: integer loads are done by 'memcpy' to avoid unaligned access.
+***/
+template<size_t Size> struct EmPersistentUIntOf {};
+template<> struct EmPersistentUIntOf<1> { typedef uint8_t Type; };
+template<> struct EmPersistentUIntOf<2> { typedef uint16_t Type; };
+template<> struct EmPersistentUIntOf<4> { typedef uint32_t Type; };
+template<> struct EmPersistentUIntOf<8> { typedef uint64_t Type; };
+
+enum class EmPersistentKernelKind { scalar, words, bytes };
+
+template<size_t Size, EmPersistentKernelKind Kind>
+struct EmPersistentKernelOf {
+    static bool Equal(const void* pValue1, const void* pValue2) {
+        return 0 == memcmp(pValue1, pValue2, Size);
+    }
+
+    static void Copy(void* pDest, const void* pSrc) {
+        memcpy(pDest, pSrc, Size);
+    }
+};
+
+template<size_t Size>
+struct EmPersistentKernelOf<Size, EmPersistentKernelKind::scalar> {
+    typedef typename EmPersistentUIntOf<Size>::Type UInt;
+
+    static bool Equal(const void* pValue1, const void* pValue2) {
+        UInt value1, value2;
+        memcpy(&value1, pValue1, Size);
+        memcpy(&value2, pValue2, Size);
+        return value1 == value2;
+    }
+
+    static void Copy(void* pDest, const void* pSrc) {
+        UInt value;
+        memcpy(&value, pSrc, Size);
+        memcpy(pDest, &value, Size);
+    }
+};
+
+template<size_t Size>
+struct EmPersistentKernelOf<Size, EmPersistentKernelKind::words> {
+    static bool Equal(const void* pValue1, const void* pValue2) {
+        const uint8_t* p1 = (const uint8_t*)pValue1;
+        const uint8_t* p2 = (const uint8_t*)pValue2;
+        // NOTE: 'Size' is a constant, compilers fully unroll this loop
+        uint32_t diff = 0;
+        for (size_t i=0; i < Size; i += sizeof(uint32_t)) {
+            uint32_t word1, word2;
+            memcpy(&word1, p1+i, sizeof(word1));
+            memcpy(&word2, p2+i, sizeof(word2));
+            diff |= word1 ^ word2;
+        }
+        return 0 == diff;
+    }
+
+    static void Copy(void* pDest, const void* pSrc) {
+        memcpy(pDest, pSrc, Size);
+    }
+};
+
+template<size_t Size>
+struct EmPersistentKernel {
+    // The largest values compared word by word
+    static const size_t c_MaxWordsSize = 64;
+    static const EmPersistentKernelKind c_Kind = 
+        (1 == Size || 2 == Size || 4 == Size || 8 == Size) ? EmPersistentKernelKind::scalar :
+        (0 == Size % sizeof(uint32_t) && Size <= c_MaxWordsSize) ? EmPersistentKernelKind::words :
+        EmPersistentKernelKind::bytes;
+
+    static bool Equal(const void* pValue1, const void* pValue2) {
+        return EmPersistentKernelOf<Size, c_Kind>::Equal(pValue1, pValue2);
+    }
+
+    static void Copy(void* pDest, const void* pSrc) {
+        EmPersistentKernelOf<Size, c_Kind>::Copy(pDest, pSrc);
+    }
+};
+
+/***
+    The values comparison used by 'EmPersistentValue' operators: bitwise (i.e.
+    struct types without 'operator==' can be stored) except floating types 
+    compared by value (i.e. -0.0 equals 0.0 and NaN never equals NaN).
+***/
+template<class T>
+struct EmPersistentEquality {
+    static bool Equal(const T& value1, const T& value2) {
+        return EmPersistentKernel<sizeof(T)>::Equal(&value1, &value2);
+    }
+};
+
+template<>
+struct EmPersistentEquality<float> {
+    static bool Equal(const float& value1, const float& value2) {
+        return value1 == value2;
+    }
+};
+
+template<>
+struct EmPersistentEquality<double> {
+    static bool Equal(const double& value1, const double& value2) {
+        return value1 == value2;
+    }
+};
+
+#ifdef EM_PS_STATIC_ONLY
+/***
+    The persistent values inline buffer of static only builds. Strings have 
+    none: their text buffer is owned by the derived class (see 'EmPersistentFixedString').
+***/
+template<class T>
+class EmPersistentInlineBuffer {
+protected:
+    void* _inlineBuffer() {
+        return &m_Value;
+    }
+
+private:
+    T m_Value;
+};
+
+template<>
+class EmPersistentInlineBuffer<char*> {
+protected:
+    void* _inlineBuffer() {
+        return NULL;
+    }
+};
+#endif
+
+/***
+    The user definable persistent value having templated type
+***/
+template<class T>
+class EmPersistentValue: 
+#ifdef EM_PS_STATIC_ONLY
+    private EmPersistentInlineBuffer<T>,
+#endif
+    public EmPersistentValueBase, public EmValue<T> {
+    friend class EmPersistentState;
+public:    
+    EmPersistentValue(EmPersistentState& ps, 
+                      const EmPersistentId& id,
+                      T initValue)
+    : EmPersistentValueBase(ps, 
+                            id, 
+                            0,
+                            sizeof(T)
+#ifdef EM_PS_STATIC_ONLY
+                            , EmPersistentInlineBuffer<T>::_inlineBuffer()
+#endif
+                            ) {
+        // NOTE: 
+        //  set memory directly instead calling 'SetValue' since Address is not set!
+        memcpy(m_pValue, &initValue, m_BufferSize);
+    }
+
+    EM_PS_DEPRECATED("a non const state is required")
+    EmPersistentValue(const EmPersistentState& ps, 
+                      const EmPersistentId& id,
+                      T initValue)
+    : EmPersistentValue(const_cast<EmPersistentState&>(ps), id, initValue) {}
+
+    virtual EmGetValueResult GetValue(T& value) const {
+        return _getMem(&value);
+    }
+
+    virtual bool SetValue(const T value) {
+        // Avoid writing same value to EEPROM (only time consuming!)
+        if (Equals(value)) {
+            return true;
+        }
+        _setMem(&value);
+        return _updateValue();
+    }
+
+    // NOTE: stored bytes are compared (i.e. a floating -0.0 is written over 0.0)
+    virtual bool Equals(const T value) {
+        return _equalMem(&value);
+    }
+
+    // NOTE: values are compared by 'EmPersistentEquality' 
+    virtual bool operator==(const T& other) const { 
+        return EmPersistentEquality<T>::Equal((T)*this, other); 
+    }
+
+    virtual bool operator!=(const T& other) const { 
+        return !EmPersistentEquality<T>::Equal((T)*this, other); 
+    }
+
+    virtual operator T() const { 
+        T v;
+        _copyMem(&v, m_pValue);
+        return v; 
+    }
+
+    virtual operator void*() const { 
+        return (void*)m_pValue; 
+    }
+
+    virtual T operator =(T value) { 
+        SetValue(value);
+        return value; 
+    }
+
+protected:
+    typedef EmPersistentKernel<sizeof(T)> _Kernel;
+
+    virtual EmGetValueResult _getMem(void* pValue) const {
+        EmGetValueResult res = _equalMem(pValue) ?
+                               EmGetValueResult::succeedEqualValue :
+                               EmGetValueResult::succeedNotEqualValue;
+        _copyMem(pValue, m_pValue);
+        return res;
+    }
+
+    virtual void _setMem(const void* pValue) {
+        _copyMem(m_pValue, pValue);
+    }
+
+    // Compare the value buffer, the kernel is used when it holds a 'T' 
+    // (i.e. not a derived class buffer like the strings text)
+    bool _equalMem(const void* pValue) const {
+        return sizeof(T) == m_BufferSize ? _Kernel::Equal(m_pValue, pValue) :
+                                           0 == memcmp(m_pValue, pValue, m_BufferSize);
+    }
+
+    // Copy a value buffer (see '_equalMem')
+    void _copyMem(void* pDest, const void* pSrc) const {
+        if (sizeof(T) == m_BufferSize) {
+            _Kernel::Copy(pDest, pSrc);
+        } else {
+            memcpy(pDest, pSrc, m_BufferSize);
+        }
+    }
+
+    // Read the default value pointed by 'pDefault' (see 'EM_PS_DEFAULTS_PROGMEM')
+    static T _readDefault(const T* pDefault) {
+        T value;
+        EM_PS_READ_DEFAULT(&value, pDefault, sizeof(T));
+        return value;
+    }
+
+    EmPersistentValue(EmPersistentState& ps,
+                      const EmPersistentId& id,
+                      ps_address_t address,
+                      ps_size_t size,
+                      void* pValue)
+     : EmPersistentValueBase(ps, id, address, size, pValue) {}
+};
+
+/***
+    The persistent value having a default kept in constant memory (e.g. flash or a 
+    'PROGMEM' table, see 'EM_PS_DEFAULTS_PROGMEM'). 
+    The value is stored only when set to a value different from its default, 
+    when not stored the value is its default.
+
+    Usage example:
+
+        static const uint16_t c_PortDefault = 1883;
+        EmPersistentDefaultValue<uint16_t> portVal = 
+            EmPersistentDefaultValue<uint16_t>(PS, "prt", &c_PortDefault);
+***/
+template<class T>
+class EmPersistentDefaultValue: public EmPersistentValue<T> {
+public:    
+    EmPersistentDefaultValue(EmPersistentState& ps, 
+                             const EmPersistentId& id,
+                             const T* pDefault)
+    : EmPersistentValue<T>(ps, id, EmPersistentValue<T>::_readDefault(pDefault)),
+      m_pDefault(pDefault) {}
+
+    virtual T operator =(T value) { 
+        return EmPersistentValue<T>::operator=(value);
+    }
+
+protected:
+    virtual bool _hasDefault() const {
+        return true;
+    }
+
+    virtual bool _isDefault() const {
+        const T defaultValue = EmPersistentValue<T>::_readDefault(m_pDefault);
+        return EmPersistentValue<T>::_Kernel::Equal(this->m_pValue, &defaultValue);
+    }
+
+    virtual void _setDefault() {
+        EM_PS_READ_DEFAULT(this->m_pValue, m_pDefault, sizeof(T));
+    }
+
+private:
+    const T* m_pDefault;
+};
+
+// Common value types
+typedef EmPersistentValue<int8_t> EmPersistentInt8;
+typedef EmPersistentValue<uint8_t> EmPersistentUInt8;
+typedef EmPersistentValue<int16_t> EmPersistentInt16;
+typedef EmPersistentValue<uint16_t> EmPersistentUInt16;
+typedef EmPersistentValue<int32_t> EmPersistentInt32;
+typedef EmPersistentValue<uint32_t> EmPersistentUInt32;
+typedef EmPersistentValue<int64_t> EmPersistentInt64;
+typedef EmPersistentValue<uint64_t> EmPersistentUInt64;
+typedef EmPersistentValue<float> EmPersistentFloat;
+typedef EmPersistentValue<double> EmPersistentDouble;
+
+/***
+    The serialization traits of 'T' stored by 'EmPersistentSerialized<T>': 
+    the encoded size and the Encode/Decode methods.
+    Scalars and arrays are encoded little endian without padding, structs 
+    and classes need a user specialization listing their members.
+
+    Usage example:
+
+        struct Config {
+            uint8_t mode;
+            int32_t offset;
+            uint16_t limits[2];
+        };
+
+        // 11 bytes stored instead of 'sizeof(Config)' (i.e. 12 or 16)
+        template<> struct EmPersistentTraits<Config>: 
+            EmPersistentFieldsTraits<Config, EM_PS_MEMBER(Config, mode),
+                                             EM_PS_MEMBER(Config, offset),
+                                             EM_PS_MEMBER(Config, limits)> {};
+***/
+template<typename T>
+struct EmPersistentTraits;
+
+// Scalars little endian traits (i.e. stored images independent of the CPU)
+template<typename T>
+struct EmPersistentScalarTraits {
+    typedef typename EmPersistentUIntOf<sizeof(T)>::Type UInt;
+
+    static constexpr ps_size_t c_Size = (ps_size_t)sizeof(T);
+
+    static void Encode(const T& value, uint8_t* pBytes) {
+        UInt bits;
+        memcpy(&bits, &value, sizeof(T));
+        // NOTE: 'sizeof(T)' is a constant, compilers fully unroll this loop
+        for (size_t i=0; i < sizeof(T); i++) {
+            pBytes[i] = (uint8_t)(bits >> (8*i));
+        }
+    }
+
+    static void Decode(const uint8_t* pBytes, T& value) {
+        UInt bits = 0;
+        for (size_t i=0; i < sizeof(T); i++) {
+            bits = (UInt)(bits | ((UInt)pBytes[i] << (8*i)));
+        }
+        memcpy(&value, &bits, sizeof(T));
+    }
+};
+
+template<> struct EmPersistentTraits<bool>: EmPersistentScalarTraits<bool> {};
+template<> struct EmPersistentTraits<char>: EmPersistentScalarTraits<char> {};
+template<> struct EmPersistentTraits<int8_t>: EmPersistentScalarTraits<int8_t> {};
+template<> struct EmPersistentTraits<uint8_t>: EmPersistentScalarTraits<uint8_t> {};
+template<> struct EmPersistentTraits<int16_t>: EmPersistentScalarTraits<int16_t> {};
+template<> struct EmPersistentTraits<uint16_t>: EmPersistentScalarTraits<uint16_t> {};
+template<> struct EmPersistentTraits<int32_t>: EmPersistentScalarTraits<int32_t> {};
+template<> struct EmPersistentTraits<uint32_t>: EmPersistentScalarTraits<uint32_t> {};
+template<> struct EmPersistentTraits<int64_t>: EmPersistentScalarTraits<int64_t> {};
+template<> struct EmPersistentTraits<uint64_t>: EmPersistentScalarTraits<uint64_t> {};
+template<> struct EmPersistentTraits<float>: EmPersistentScalarTraits<float> {};
+template<> struct EmPersistentTraits<double>: EmPersistentScalarTraits<double> {};
+
+template<typename T, size_t N>
+struct EmPersistentTraits<T[N]> {
+    static constexpr ps_size_t c_Size = (ps_size_t)(N*EmPersistentTraits<T>::c_Size);
+
+    static void Encode(const T (&value)[N], uint8_t* pBytes) {
+        for (size_t i=0; i < N; i++) {
+            EmPersistentTraits<T>::Encode(value[i], pBytes + i*EmPersistentTraits<T>::c_Size);
+        }
+    }
+
+    static void Decode(const uint8_t* pBytes, T (&value)[N]) {
+        for (size_t i=0; i < N; i++) {
+            EmPersistentTraits<T>::Decode(pBytes + i*EmPersistentTraits<T>::c_Size, value[i]);
+        }
+    }
+};
+
+// A member of 'T' encoded by its own traits
+template<typename T, typename M, M T::*Member>
+struct EmPersistentMember {
+    static constexpr ps_size_t c_Size = EmPersistentTraits<M>::c_Size;
+
+    static void Encode(const T& value, uint8_t* pBytes) {
+        EmPersistentTraits<M>::Encode(value.*Member, pBytes);
+    }
+
+    static void Decode(const uint8_t* pBytes, T& value) {
+        EmPersistentTraits<M>::Decode(pBytes, value.*Member);
+    }
+};
+
+#define EM_PS_MEMBER(T, member) EmPersistentMember<T, decltype(T::member), &T::member>
+
+// The members of 'T' packed in their listed order
+template<typename T, typename... Members>
+struct EmPersistentFieldsTraits;
+
+template<typename T>
+struct EmPersistentFieldsTraits<T> {
+    static constexpr ps_size_t c_Size = 0;
+
+    static void Encode(const T&, uint8_t*) {
+    }
+
+    static void Decode(const uint8_t*, T&) {
+    }
+};
+
+template<typename T, typename Member, typename... Rest>
+struct EmPersistentFieldsTraits<T, Member, Rest...> {
+    static constexpr ps_size_t c_Size = (ps_size_t)(Member::c_Size + 
+                                                    EmPersistentFieldsTraits<T, Rest...>::c_Size);
+
+    static void Encode(const T& value, uint8_t* pBytes) {
+        Member::Encode(value, pBytes);
+        EmPersistentFieldsTraits<T, Rest...>::Encode(value, pBytes + Member::c_Size);
+    }
+
+    static void Decode(const uint8_t* pBytes, T& value) {
+        Member::Decode(pBytes, value);
+        EmPersistentFieldsTraits<T, Rest...>::Decode(pBytes + Member::c_Size, value);
+    }
+};
+
+/***
+    The persistent value storing 'T' encoded by its 'EmPersistentTraits<T>' 
+    (i.e. packed, little endian, not trivially copyable types supported).
+    'T' must be default constructible, values are compared once encoded.
+
+    Usage example:
+
+        EmPersistentSerialized<Config> config = 
+            EmPersistentSerialized<Config>(PS, "cfg", defaultConfig);
+***/
+template<class T>
+class EmPersistentSerialized: public EmPersistentValueBase, public EmValue<T> {
+public:
+    typedef EmPersistentTraits<T> Traits;
+
+    static_assert(Traits::c_Size > 0, "Serialized value without stored bytes");
+
+    EmPersistentSerialized(EmPersistentState& ps, 
+                           const EmPersistentId& id,
+                           const T& initValue)
+#ifdef EM_PS_STATIC_ONLY
+    : EmPersistentValueBase(ps, id, (ps_address_t)0, Traits::c_Size, m_Encoded) {
+#else
+    : EmPersistentValueBase(ps, id, (ps_address_t)0, Traits::c_Size) {
+#endif
+        if (0 != m_BufferSize) {
+            Traits::Encode(initValue, (uint8_t*)m_pValue);
+        }
+    }
+
+    virtual EmGetValueResult GetValue(T& value) const {
+        EmGetValueResult res = _equals(value) ?
+                               EmGetValueResult::succeedEqualValue :
+                               EmGetValueResult::succeedNotEqualValue;
+        Traits::Decode((const uint8_t*)m_pValue, value);
+        return res;
+    }
+
+    virtual bool SetValue(const T value) {
+        uint8_t encoded[Traits::c_Size];
+        Traits::Encode(value, encoded);
+        // Avoid writing same value to EEPROM (only time consuming!)
+        if (0 == m_BufferSize || 0 == memcmp(encoded, m_pValue, Traits::c_Size)) {
+            return 0 != m_BufferSize;
+        }
+        memcpy(m_pValue, encoded, Traits::c_Size);
+        return _updateValue();
+    }
+
+    virtual bool Equals(const T value) {
+        return _equals(value);
+    }
+
+    virtual operator T() const { 
+        T value;
+        Traits::Decode((const uint8_t*)m_pValue, value);
+        return value; 
+    }
+
+    virtual T operator =(T value) { 
+        SetValue(value);
+        return value; 
+    }
+
+protected:
+    bool _equals(const T& value) const {
+        uint8_t encoded[Traits::c_Size];
+        Traits::Encode(value, encoded);
+        return 0 != m_BufferSize && 0 == memcmp(encoded, m_pValue, Traits::c_Size);
+    }
+
+#ifdef EM_PS_STATIC_ONLY
+private:
+    // The encoded value inline buffer
+    uint8_t m_Encoded[Traits::c_Size];
+#endif
+};
+
+/***
+    The persistent value presenting a 'V' (i.e. float or double) value to the 
+    application but storing a compact 'S' integer (i.e. up to 32 bits):
+
+        value = stored * ScaleNum / ScaleDen + Offset
+
+    Values are rounded to the nearest stored unit and clamped to the 'S' range, 
+    conversions are constexpr (i.e. done at compile time for constants).
+
+    Usage example:
+
+        // -40.00 to 615.35 C with 0.01 C resolution (i.e. 2 bytes instead of 4)
+        EmPersistentQuantized<float, uint16_t, 1, 100, -40> tempSetpoint = 
+            EmPersistentQuantized<float, uint16_t, 1, 100, -40>(PS, "tsp", 21.5f);
+
+        void loop() {
+            tempSetpoint = 22.25f;
+            float setpoint = tempSetpoint;
+        }
+***/
+template<typename V, typename S, int32_t ScaleNum, int32_t ScaleDen = 1, int32_t Offset = 0>
+class EmPersistentQuantized: public EmPersistentValueBase, public EmValue<V> {
+public:
+    static_assert(ScaleNum > 0 && ScaleDen > 0, "Quantized scale must be positive");
+    static_assert((S)1/(S)2 == 0 && sizeof(S) <= sizeof(uint32_t), 
+                  "Quantized storage must be an integer up to 32 bits");
+
+    // The stored integer range
+    static constexpr int64_t c_MinStored = (S)-1 > (S)0 ? 0 : -((int64_t)1 << (8*sizeof(S)-1));
+    static constexpr int64_t c_MaxStored = (S)-1 > (S)0 ? ((int64_t)1 << (8*sizeof(S)))-1 : 
+                                                          ((int64_t)1 << (8*sizeof(S)-1))-1;
+
+    EmPersistentQuantized(EmPersistentState& ps, 
+                          const EmPersistentId& id,
+                          V initValue)
+    : EmPersistentValueBase(ps, 
+                            id, 
+                            0,
+                            sizeof(S)
+#ifdef EM_PS_STATIC_ONLY
+                            , &m_Value
+#endif
+                            ) {
+        const S stored = ToStored(initValue);
+        memcpy(m_pValue, &stored, sizeof(S));
+    }
+
+    // The value of one stored unit
+    static constexpr V Resolution() {
+        return (V)ScaleNum / (V)ScaleDen;
+    }
+
+    static constexpr V Min() {
+        return FromStored((S)c_MinStored);
+    }
+
+    static constexpr V Max() {
+        return FromStored((S)c_MaxStored);
+    }
+
+    // The stored integer of 'value' (i.e. rounded and clamped, NaN is 'Offset')
+    static constexpr S ToStored(V value) {
+        return _toStored((value - (V)Offset) * (V)ScaleDen / (V)ScaleNum);
+    }
+
+    // The value of a stored integer
+    static constexpr V FromStored(S stored) {
+        return (V)stored * (V)ScaleNum / (V)ScaleDen + (V)Offset;
+    }
+
+    // The stored integer
+    S Stored() const {
+        S stored;
+        memcpy(&stored, m_pValue, sizeof(S));
+        return stored;
+    }
+
+    virtual EmGetValueResult GetValue(V& value) const {
+        const V current = FromStored(Stored());
+        EmGetValueResult res = current == value ? 
+                               EmGetValueResult::succeedEqualValue :
+                               EmGetValueResult::succeedNotEqualValue;
+        value = current;
+        return res;
+    }
+
+    // NOTE: NaN has no quantized value, it is rejected
+    virtual bool SetValue(const V value) {
+        if (value != value) {
+            return false;
+        }
+        // Avoid writing same stored value to EEPROM (only time consuming!)
+        if (Equals(value)) {
+            return true;
+        }
+        const S stored = ToStored(value);
+        memcpy(m_pValue, &stored, sizeof(S));
+        return _updateValue();
+    }
+
+    // NOTE: values are compared once quantized
+    virtual bool Equals(const V value) {
+        return ToStored(value) == Stored();
+    }
+
+    virtual operator V() const { 
+        return FromStored(Stored()); 
+    }
+
+    virtual V operator =(V value) { 
+        SetValue(value);
+        return value; 
     }
 
 protected:
-    const EmPersistentState& m_Ps;
-    EmPersistentId m_Id;
-    ps_address_t m_Address;
-    ps_size_t m_BufferSize;
-    void* m_pValue;
+    // Round & clamp the scaled value
+    // NOTE: NaN fails all the comparisons, it is checked first (i.e. its 
+    //       integer conversion is undefined)
+    static constexpr S _toStored(V scaled) {
+        return scaled != scaled ? (S)0 :
+               scaled <= (V)c_MinStored ? (S)c_MinStored :
+               scaled >= (V)c_MaxStored ? (S)c_MaxStored :
+               scaled >= 0 ? (S)(int64_t)(scaled + (V)0.5) : 
+                             (S)-(int64_t)(-scaled + (V)0.5);
+    }
+
+#ifdef EM_PS_STATIC_ONLY
+private:
+    // The stored integer inline buffer
+    S m_Value;
+#endif
 };
 
-inline bool _itemsMatch(const EmPersistentValueBase& pv1, 
-                        const EmPersistentValueBase& pv2) { 
-    // This method is used to see if two items are the same in terms of EEPROM storage
-    return pv1.Match(pv2); 
+// The bits needed for values from zero to 'span'
+constexpr uint8_t EmPersistentBitsFor(uint32_t span) {
+    return span <= 1 ? 1 : (uint8_t)(1 + EmPersistentBitsFor(span >> 1));
 }
 
+// A bit field of 'Bits' width holding values from 'Min' to 'Max' 
+// (i.e. stored as 'value - Min')
+template<uint8_t Bits, int32_t Min = 0, int32_t Max = Min + (int32_t)((1UL << Bits) - 1)>
+struct EmPersistentBitField {
+    // NOTE: up to 24 bits, fields are accessed as 32 bits words
+    static_assert(Bits > 0 && Bits <= 24, "Bit field width must be from 1 to 24 bits");
+    static_assert(Min <= Max && (uint32_t)(Max - Min) < (1UL << Bits), 
+                  "Bit field range doesn't fit its width");
+    static constexpr uint8_t c_Bits = Bits;
+    static constexpr int32_t c_Min = Min;
+    static constexpr int32_t c_Max = Max;
+};
+
+// A bit field holding values from 'Min' to 'Max' in the minimum bits
+template<int32_t Min, int32_t Max>
+struct EmPersistentRangeField: public EmPersistentBitField<EmPersistentBitsFor((uint32_t)(Max - Min)), 
+                                                           Min, 
+                                                           Max> {
+};
+
+// The field at 'I' and its bits offset
+template<uint8_t I, typename... Fields>
+struct EmPersistentBitsAt;
+
+template<typename Field, typename... Rest>
+struct EmPersistentBitsAt<0, Field, Rest...> {
+    typedef Field type;
+    static constexpr uint16_t offset = 0;
+};
+
+template<uint8_t I, typename Field, typename... Rest>
+struct EmPersistentBitsAt<I, Field, Rest...> {
+    typedef typename EmPersistentBitsAt<(uint8_t)(I-1), Rest...>::type type;
+    static constexpr uint16_t offset = (uint16_t)(Field::c_Bits + 
+                                                 EmPersistentBitsAt<(uint8_t)(I-1), Rest...>::offset);
+};
+
+// The bits of all fields
+template<typename... Fields>
+struct EmPersistentBitsSum;
+
+template<>
+struct EmPersistentBitsSum<> {
+    static constexpr uint16_t value = 0;
+};
+
+template<typename Field, typename... Rest>
+struct EmPersistentBitsSum<Field, Rest...> {
+    static constexpr uint16_t value = (uint16_t)(Field::c_Bits + EmPersistentBitsSum<Rest...>::value);
+};
+
 /***
-    The user definable persistent value having templated type
+    The persistent record packing small enums and ranged integers into the 
+    minimum bits (i.e. one record header for all fields). 
+    Fields are declared at compile time (see 'EmPersistentBitField' and 
+    'EmPersistentRangeField') and accessed by their index, accessors are
+    compile time shifts and masks. Setters only write the bytes holding the 
+    changed field.
+    Fields are initialized to their minimum value.
+
+    Usage example:
+
+        enum { mode, level, enabled };
+
+        EmPersistentBits<EmPersistentRangeField<0, 7>,     // mode
+                         EmPersistentRangeField<0, 100>,   // level
+                         EmPersistentBitField<1>> settings = // enabled
+            EmPersistentBits<EmPersistentRangeField<0, 7>, 
+                             EmPersistentRangeField<0, 100>, 
+                             EmPersistentBitField<1>>(PS, "set");
+
+        void loop() {
+            settings.Set<level>(42);
+            if (settings.Get<enabled>()) {
+                ...
+            }
+        }
 ***/
-template<class T>
-class EmPersistentValue: public EmPersistentValueBase, public EmValue<T> {
-    friend class EmPersistentState;
-public:    
-    EmPersistentValue(const EmPersistentState& ps, 
-                      const char* id,
-                      T initValue)
-    : EmPersistentValueBase(ps, 
-                            id, 
-                            0,
-                            sizeof(T)) {
-        // NOTE: 
-        //  set memory directly instead calling 'SetValue' since Address is not set!
-        memcpy(m_pValue, &initValue, m_BufferSize);
+template<typename... Fields>
+class EmPersistentBits: public EmPersistentValueBase {
+public:
+    static_assert(sizeof...(Fields) > 0, "Bits record without fields");
+
+    // The number of fields
+    static constexpr uint8_t c_Fields = (uint8_t)sizeof...(Fields);
+    // The stored bytes
+    static constexpr ps_size_t c_Size = (ps_size_t)((EmPersistentBitsSum<Fields...>::value + 7) / 8);
+
+    EmPersistentBits(EmPersistentState& ps,
+                     const EmPersistentId& id)
+#ifdef EM_PS_STATIC_ONLY
+    : EmPersistentValueBase(ps, id, (ps_address_t)0, c_Size, m_Bytes) {
+        memset(m_Bytes, 0, sizeof(m_Bytes));
+    }
+#else
+    : EmPersistentValueBase(ps, id, (ps_address_t)0, c_Size) {}
+#endif
+
+    // The field 'I' value
+    template<uint8_t I>
+    int32_t Get() const {
+        return (int32_t)((_load<I>() & Mask<I>()) >> Shift<I>()) + FieldAt<I>::c_Min;
+    }
+
+    // Set the field 'I' value, false if out of the field range
+    template<uint8_t I>
+    bool Set(int32_t value) {
+        if (value < FieldAt<I>::c_Min || value > FieldAt<I>::c_Max || 0 == m_BufferSize) {
+            return false;
+        }
+        const uint32_t word = _load<I>();
+        const uint32_t bits = (word & ~Mask<I>()) | 
+                              ((uint32_t)(value - FieldAt<I>::c_Min) << Shift<I>());
+        if (bits == word) {
+            // Avoid writing same value to EEPROM (only time consuming!)
+            return true;
+        }
+        uint8_t* pBytes = (uint8_t*)m_pValue + First<I>();
+        for (uint8_t i = 0; i < Bytes<I>(); i++) {
+            pBytes[i] = (uint8_t)(bits >> (8*i));
+        }
+        return _updateValue(First<I>(), Bytes<I>());
+    }
+
+    // The first byte holding field 'I'
+    template<uint8_t I>
+    static constexpr ps_size_t First() {
+        return (ps_size_t)(EmPersistentBitsAt<I, Fields...>::offset / 8);
+    }
+
+    // The number of bytes holding field 'I'
+    template<uint8_t I>
+    static constexpr uint8_t Bytes() {
+        return (uint8_t)((Shift<I>() + FieldAt<I>::c_Bits + 7) / 8);
+    }
+
+    // The field 'I' shift within its bytes
+    template<uint8_t I>
+    static constexpr uint8_t Shift() {
+        return (uint8_t)(EmPersistentBitsAt<I, Fields...>::offset % 8);
+    }
+
+    // The field 'I' mask within its bytes
+    template<uint8_t I>
+    static constexpr uint32_t Mask() {
+        return ((1UL << FieldAt<I>::c_Bits) - 1) << Shift<I>();
+    }
+
+protected:
+    template<uint8_t I>
+    using FieldAt = typename EmPersistentBitsAt<I, Fields...>::type;
+
+    // Load the bytes holding field 'I' (i.e. little endian)
+    template<uint8_t I>
+    uint32_t _load() const {
+        static_assert(I < sizeof...(Fields), "Bit field index out of range");
+        const uint8_t* pBytes = (const uint8_t*)m_pValue + First<I>();
+        uint32_t word = 0;
+        for (uint8_t i = 0; i < Bytes<I>() && 0 != m_BufferSize; i++) {
+            word |= (uint32_t)pBytes[i] << (8*i);
+        }
+        return word;
+    }
+
+#ifdef EM_PS_STATIC_ONLY
+private:
+    // The packed fields inline buffer
+    uint8_t m_Bytes[c_Size];
+#endif
+};
+
+/***
+    The persistent value keeping its 'Depth' previous versions in a ring stored
+    within the same record, followed by a one byte metadata (i.e. the current 
+    slot and the number of previous versions).
+    New values are written into the next slot before flipping the metadata, 
+    'Rollback' only rewrites the metadata byte (i.e. one EEPROM write).
+    
+    NOTE: values needing a consistent rollback must be kept in one history 
+          value (e.g. a configuration struct).
+
+    Usage example:
+
+        EmPersistentHistory<Config, 3> config = 
+            EmPersistentHistory<Config, 3>(PS, "cfg", defaultConfig);
+
+        void onConfigPush(const Config& newConfig) {
+            config = newConfig;
+        }
+
+        void onConfigFailure() {
+            config.Rollback();
+        }
+***/
+template<typename T, uint8_t Depth>
+class EmPersistentHistory: public EmPersistentValueBase, public EmValue<T> {
+public:
+    // NOTE: current slot and versions count share the metadata byte
+    static_assert(Depth > 0 && Depth < 15, "History depth must be from 1 to 14");
+
+    // The ring slots (i.e. current value and its previous versions)
+    static constexpr uint8_t c_Slots = (uint8_t)(Depth + 1);
+    // The stored bytes
+    static constexpr ps_size_t c_Size = (ps_size_t)(c_Slots*sizeof(T) + 1);
+
+    EmPersistentHistory(EmPersistentState& ps, 
+                        const EmPersistentId& id,
+                        T initValue)
+#ifdef EM_PS_STATIC_ONLY
+    : EmPersistentValueBase(ps, id, (ps_address_t)0, c_Size, m_Buffer) {
+        memset(m_Buffer, 0, sizeof(m_Buffer));
+#else
+    : EmPersistentValueBase(ps, id, (ps_address_t)0, c_Size) {
+#endif
+        if (0 != m_BufferSize) {
+            memcpy(_slot(0), &initValue, sizeof(T));
+        }
+    }
+
+    // The number of previous versions available for 'Rollback'
+    uint8_t History() const {
+        return (uint8_t)(_meta() >> 4);
+    }
+
+    // Get the version 'steps' back (i.e. zero is the current value)
+    bool GetVersion(uint8_t steps, T& value) const {
+        if (steps > History()) {
+            return false;
+        }
+        memcpy(&value, _slot(_back(steps)), sizeof(T));
+        return true;
+    }
+
+    // Restore the version 'steps' back, later versions are dropped
+    bool Rollback(uint8_t steps = 1) {
+        if (0 == steps || steps > History()) {
+            return false;
+        }
+        return _setMeta(_back(steps), (uint8_t)(History() - steps));
     }
 
     virtual EmGetValueResult GetValue(T& value) const {
-        return _getMem(&value);
+        EmGetValueResult res = 0 == memcmp(&value, _current(), sizeof(T)) ?
+                               EmGetValueResult::succeedEqualValue :
+                               EmGetValueResult::succeedNotEqualValue;
+        memcpy(&value, _current(), sizeof(T));
+        return res;
     }
 
     virtual bool SetValue(const T value) {
@@ -373,62 +2962,74 @@ public:
         if (Equals(value)) {
             return true;
         }
-        _setMem(&value);
-        return _updateValue();
+        // Write the next slot first (i.e. current value kept on power loss)
+        const uint8_t next = (uint8_t)((_head() + 1) % c_Slots);
+        memcpy(_slot(next), &value, sizeof(T));
+        if (!_updateValue((ps_size_t)(next*sizeof(T)), (ps_size_t)sizeof(T)) && IsStored()) {
+            return false;
+        }
+        return _setMeta(next, (uint8_t)MIN(History() + 1, Depth));
     }
 
     virtual bool Equals(const T value) {
-        return 0 == memcmp(m_pValue, &value, m_BufferSize);
+        return 0 == memcmp(&value, _current(), sizeof(T));
     }
 
-    virtual bool operator==(const T& other) const { 
-        return other == (T)*this; 
+    virtual operator T() const { 
+        T value;
+        memcpy(&value, _current(), sizeof(T));
+        return value; 
     }
 
-    virtual bool operator!=(const T& other) const { 
-        return other != (T)*this; 
+    virtual T operator =(T value) { 
+        SetValue(value);
+        return value; 
     }
 
-    virtual operator T() const { 
-        T v = 0;
-        GetValue(v);
-        return v; 
+protected:
+    uint8_t _meta() const {
+        return 0 == m_BufferSize ? 0 : ((const uint8_t*)m_pValue)[c_Size-1];
     }
 
-    virtual operator void*() const { 
-        return (void*)m_pValue; 
+    // The current slot
+    uint8_t _head() const {
+        return (uint8_t)(_meta() & 0x0F);
     }
 
-    virtual T operator =(T value) { 
-        SetValue(value);
-        return value; 
+    // The slot 'steps' back
+    uint8_t _back(uint8_t steps) const {
+        return (uint8_t)((_head() + c_Slots - steps) % c_Slots);
     }
 
-protected:
-    EmPersistentValue(const EmPersistentState& ps,
-                      const char* id,
-                      ps_address_t address,
-                      ps_size_t size,
-                      void* pValue)
-     : EmPersistentValueBase(ps, id, address, size, pValue) {}
-};
+    uint8_t* _slot(uint8_t slot) const {
+        return (uint8_t*)m_pValue + slot*sizeof(T);
+    }
 
-// Common value types
-typedef EmPersistentValue<int8_t> EmPersistentInt8;
-typedef EmPersistentValue<uint8_t> EmPersistentUInt8;
-typedef EmPersistentValue<int16_t> EmPersistentInt16;
-typedef EmPersistentValue<uint16_t> EmPersistentUInt16;
-typedef EmPersistentValue<int32_t> EmPersistentInt32;
-typedef EmPersistentValue<uint32_t> EmPersistentUInt32;
-typedef EmPersistentValue<int64_t> EmPersistentInt64;
-typedef EmPersistentValue<uint64_t> EmPersistentUInt64;
-typedef EmPersistentValue<float> EmPersistentFloat;
-typedef EmPersistentValue<double> EmPersistentDouble;
+    const uint8_t* _current() const {
+        return _slot(_head());
+    }
+
+    // Flip the metadata byte
+    bool _setMeta(uint8_t head, uint8_t history) {
+        if (0 == m_BufferSize) {
+            return false;
+        }
+        ((uint8_t*)m_pValue)[c_Size-1] = (uint8_t)((history << 4) | head);
+        return _updateValue((ps_size_t)(c_Size-1), 1);
+    }
+
+#ifdef EM_PS_STATIC_ONLY
+private:
+    // The ring and metadata inline buffer
+    uint8_t m_Buffer[c_Size];
+#endif
+};
 
 class EmPersistentString: public EmPersistentValue<char*> {
 public:
-    EmPersistentString(const EmPersistentState& ps,
-                       const char* id,
+#ifndef EM_PS_STATIC_ONLY
+    EmPersistentString(EmPersistentState& ps,
+                       const EmPersistentId& id,
                        ps_size_t maxTextLen,
                        const char* initValue)
     : EmPersistentValue(ps, id, (ps_address_t)0, (ps_size_t)(maxTextLen+1), NULL) {
@@ -436,6 +3037,14 @@ public:
         //   We NEED to copy initValue within this constructor and NOT base one!
         memcpy(m_pValue, initValue, _valueSize(initValue));
     }
+
+    EM_PS_DEPRECATED("a non const state is required")
+    EmPersistentString(const EmPersistentState& ps,
+                       const EmPersistentId& id,
+                       ps_size_t maxTextLen,
+                       const char* initValue)
+    : EmPersistentString(const_cast<EmPersistentState&>(ps), id, maxTextLen, initValue) {}
+#endif
     
     virtual EmGetValueResult GetValue(char* value) const {
         return _getMem((void*)value);
@@ -458,6 +3067,20 @@ public:
         return (const char*)m_pValue; 
     }
 
+    // NOTE: the text buffer itself (i.e. not a 'char*' value copy)
+    virtual operator char*() const { 
+        return (char*)m_pValue; 
+    }
+
+    // NOTE: texts are compared (i.e. not pointers)
+    virtual bool operator==(char* const& other) const { 
+        return NULL != other && 0 == strncmp((const char*)m_pValue, other, m_BufferSize);
+    }
+
+    virtual bool operator!=(char* const& other) const { 
+        return !(*this == other);
+    }
+
     virtual char* operator =(const char* value) {         
         SetValue(value);
         return (char*)m_pValue;
@@ -485,8 +3108,258 @@ protected:
         // -1 -> Need to leave the string terminator (i.e. max length reached!)
         return (ps_size_t)MIN(m_BufferSize-1, valueSize);
     }
+
+#ifdef EM_PS_STATIC_ONLY
+    // NOTE: 'pBuffer' MUST be 'maxTextLen+1' bytes long and owned by the derived class
+    EmPersistentString(EmPersistentState& ps,
+                       const EmPersistentId& id,
+                       ps_size_t maxTextLen,
+                       const char* initValue,
+                       char* pBuffer)
+    : EmPersistentValue(ps, id, (ps_address_t)0, (ps_size_t)(maxTextLen+1), pBuffer) {
+        memset(m_pValue, 0, m_BufferSize);
+        memcpy(m_pValue, initValue, _valueSize(initValue));
+    }
+#endif
+};
+
+/***
+    The persistent string having its max text length defined at compile time.
+    When building static only (i.e. 'EM_PS_STATIC_ONLY') the text is stored in an inline buffer.
+***/
+template<ps_size_t MaxTextLen>
+class EmPersistentFixedString: public EmPersistentString {
+public:
+    EmPersistentFixedString(EmPersistentState& ps,
+                            const EmPersistentId& id,
+                            const char* initValue)
+#ifdef EM_PS_STATIC_ONLY
+    : EmPersistentString(ps, id, MaxTextLen, initValue, m_Text) {}
+#else
+    : EmPersistentString(ps, id, MaxTextLen, initValue) {}
+#endif
+
+    EM_PS_DEPRECATED("a non const state is required")
+    EmPersistentFixedString(const EmPersistentState& ps,
+                            const EmPersistentId& id,
+                            const char* initValue)
+    : EmPersistentFixedString(const_cast<EmPersistentState&>(ps), id, initValue) {}
+
+    virtual char* operator =(const char* value) {         
+        return EmPersistentString::operator=(value);
+    }
+
+#ifdef EM_PS_STATIC_ONLY
+private:
+    // The text inline buffer
+    char m_Text[MaxTextLen+1];
+#endif
+};
+
+/***
+    The persistent value storing data (e.g. JSON like text or lookup tables) 
+    LZ compressed (see 'EmPersistentLz') within a 'StoredSize' bytes record 
+    (i.e. 2 bytes encoded size and encoded data). Only the compressed bytes 
+    are kept in RAM and written to storage, data is decoded into a caller buffer.
+
+    Usage example:
+
+        EmPersistentCompressed<64> cfgVal = EmPersistentCompressed<64>(PS, "cfg");
+
+        void loop() {
+            const char* json = "{\"mode\":\"auto\",\"modes\":[\"auto\",\"manual\"]}";
+            cfgVal.SetValue(json, strlen(json)+1);
+
+            char text[128];
+            ps_size_t size = 0;
+            cfgVal.GetValue(text, sizeof(text), size);
+        }
+
+    NOTE: 
+      'SetValue' fails if the compressed data doesn't fit (i.e. the stored value
+      is kept). Compression ratio depends on data: about 1.4x for JSON like text,
+      more for repetitive tables, none for random data (see 'extras/lz_benchmark').
+***/
+template<ps_size_t StoredSize>
+class EmPersistentCompressed: public EmPersistentValueBase {
+public:
+    static_assert(StoredSize > sizeof(uint16_t), "Compressed value stored size too small");
+
+    EmPersistentCompressed(EmPersistentState& ps,
+                           const EmPersistentId& id)
+#ifdef EM_PS_STATIC_ONLY
+    : EmPersistentValueBase(ps, id, (ps_address_t)0, StoredSize, m_Stored) {
+        memset(m_Stored, 0, sizeof(m_Stored));
+    }
+#else
+    : EmPersistentValueBase(ps, id, (ps_address_t)0, StoredSize) {}
+#endif
+
+    // Compress and store 'size' bytes of 'pData'
+    bool SetValue(const void* pData, ps_size_t size) {
+        const ps_size_t maxEncodedSize = (ps_size_t)(StoredSize - sizeof(uint16_t));
+        uint8_t* pStored = (uint8_t*)m_pValue;
+        uint16_t encodedSize = 0;
+        if (NULL == pStored) {
+            return false;
+        }
+        if (!EmPersistentLz::Encode((const uint8_t*)pData, size, 
+                                    pStored + sizeof(uint16_t), maxEncodedSize, encodedSize)) {
+            // Not fitting, restore the stored value (i.e. empty if not stored yet)
+            if (!_readValue()) {
+                memset(pStored, 0, StoredSize);
+            }
+            return false;
+        }
+        EmPersistentTraits<uint16_t>::Encode(encodedSize, pStored);
+        // NOTE: only changed bytes are written (i.e. old trailing bytes are left)
+        return _updateValue();
+    }
+
+    // Decode the value into 'pData' which is 'maxSize' bytes long.
+    // Return false if it doesn't fit or stored data is corrupted.
+    bool GetValue(void* pData, ps_size_t maxSize, ps_size_t& size) const {
+        const uint16_t encodedSize = EncodedSize();
+        if (encodedSize > StoredSize - sizeof(uint16_t)) {
+            return false;
+        }
+        return EmPersistentLz::Decode((const uint8_t*)m_pValue + sizeof(uint16_t), encodedSize,
+                                      (uint8_t*)pData, maxSize, size);
+    }
+
+    // The compressed data size
+    ps_size_t EncodedSize() const {
+        uint16_t encodedSize = 0;
+        if (NULL != m_pValue) {
+            EmPersistentTraits<uint16_t>::Decode((const uint8_t*)m_pValue, encodedSize);
+        }
+        return encodedSize;
+    }
+
+#ifdef EM_PS_STATIC_ONLY
+private:
+    // The compressed data inline buffer
+    uint8_t m_Stored[StoredSize];
+#endif
+};
+
+/***
+    The persistent value registry: a contiguous array of persistent values pointers.
+    It is used instead of an 'EmPersistentValueList' to initialize the persistent 
+    state without allocating list nodes. The registry can be a compile time constant.
+
+    Usage example:
+
+        EmPersistentValueBase* const values[] = { &floatVal, &intVal, &textVal };
+        const EmPersistentValueRegistry registry(values);
+
+        void setup() {
+            PS.Init(registry, false);
+        }
+
+    NOTE: 
+      when values are sorted (see 'Sort') stored values matching is done by a 
+      binary search instead of a linear one.
+***/
+class EmPersistentValueRegistry {
+public:
+    template<uint16_t N>
+    constexpr EmPersistentValueRegistry(EmPersistentValueBase* const (&values)[N])
+     : m_pValues(values),
+       m_Count(N) {}
+
+    constexpr EmPersistentValueRegistry(EmPersistentValueBase* const values[], uint16_t count)
+     : m_pValues(values),
+       m_Count(count) {}
+
+    uint16_t Count() const {
+        return m_Count;
+    }
+
+    EmPersistentValueBase* operator[](uint16_t index) const {
+        return m_pValues[index];
+    }
+
+    // Checks if registry values are sorted (i.e. by id & size)
+    bool IsSorted() const;
+
+    // Find the registry value matching 'id' & 'size' or NULL if not found.
+    // NOTE: set 'sorted' only if 'IsSorted' returned true!
+    EmPersistentValueBase* Find(const EmPersistentId& id, 
+                                ps_size_t size,
+                                bool sorted = false) const;
+
+    // Checks if some registry values have the same hashed ID and size (e.g. 
+    // long IDs with same hash or a long ID registered by two values).
+    // Collisions are logged to 'log' as warnings: 'Init' assigns the stored
+    // value to the first one.
+    bool HasCollisions(const EmLog& log) const;
+
+    // Sort 'count' values of the 'values' array by id & size
+    static void Sort(EmPersistentValueBase* values[], uint16_t count);
+
+private:
+    EmPersistentValueBase* const* m_pValues;
+    uint16_t m_Count;
+};
+
+/***
+    The persistent value view: a stored value description read without allocating memory
+***/
+class EmPersistentValueView {
+    friend class EmPersistentState;
+public:
+    EmPersistentValueView() 
+     : m_pPs(NULL),
+       m_Address(0),
+       m_Size(0), 
+       m_EndReached(false) {}
+
+    void Reset() {
+        m_pPs = NULL;
+        m_Address = 0;
+        m_Size = 0;
+        m_EndReached = false;
+    }
+
+    const EmPersistentId& Id() const {
+        return m_Id;
+    }
+
+    ps_address_t Address() const {
+        return m_Address;
+    }
+
+    ps_size_t Size() const {
+        return m_Size;
+    }
+
+    bool EndReached() const {
+        return m_EndReached;
+    }
+
+    // Read the stored value into 'pValue' which is 'size' bytes long.
+    // Return false if 'size' is smaller than the stored value size.
+    bool Read(void* pValue, ps_size_t size) const;
+
+protected:
+    ps_address_t _valueAddress() const {
+        return (ps_address_t)(m_Address+EmPersistentLayout::HeaderSize());
+    }
+
+    ps_address_t _nextPvAddress() const {
+        return (ps_address_t)(m_Address+EmPersistentLayout::RecordSize(m_Size));
+    }
+
+private:
+    const EmPersistentState* m_pPs;
+    EmPersistentId m_Id;
+    ps_address_t m_Address;
+    ps_size_t m_Size;
+    bool m_EndReached;
 };
 
+#ifndef EM_PS_STATIC_ONLY
 /***
     The persistent values iterator
 ***/
@@ -533,3 +3406,4 @@ private:
     EmPersistentValueBase* m_pItem;
     bool m_EndReached;
 };
+#endif // EM_PS_STATIC_ONLY
@@ -0,0 +1,123 @@
+#include "em_persistent_lz.h"
+
+
+  //--------------------------------------------------
+ // EmPersistentLz class implementation   
+//--------------------------------------------------
+bool EmPersistentLz::Encode(const uint8_t* src, 
+                            uint16_t size, 
+                            uint8_t* dst, 
+                            uint16_t dstSize,
+                            uint16_t& encodedSize) {
+    uint16_t out = 0;
+    uint16_t flagsIndex = 0;
+    uint8_t flag = 8;
+    uint16_t pos = 0;
+    while (pos < size) {
+        // Start a new items group
+        if (8 == flag) {
+            if (out >= dstSize) {
+                return false;
+            }
+            flagsIndex = out++;
+            if (NULL != dst) {
+                dst[flagsIndex] = 0;
+            }
+            flag = 0;
+        }
+        // Find the longest match within the window (i.e. nearest first)
+        uint16_t bestLen = 0;
+        uint16_t bestDist = 0;
+        const uint16_t maxDist = pos < c_Window ? pos : c_Window;
+        const uint16_t maxLen = (uint16_t)(size - pos) < c_MaxMatch ? (uint16_t)(size - pos) : c_MaxMatch;
+        for (uint16_t dist=1; dist <= maxDist && bestLen < maxLen; dist++) {
+            const uint8_t* pMatch = src + pos - dist;
+            uint16_t len = 0;
+            // NOTE: the match may overlap the current position (i.e. repeated bytes)
+            while (len < maxLen && pMatch[len] == src[pos + len]) {
+                len++;
+            }
+            if (len > bestLen) {
+                bestLen = len;
+                bestDist = dist;
+            }
+        }
+        if (bestLen >= c_MinMatch) {
+            // Back reference (i.e. long ones having a length extension byte)
+            const bool extended = bestLen >= c_ExtendedMatch;
+            const uint16_t refSize = extended ? 3 : 2;
+            if (out + refSize > dstSize) {
+                return false;
+            }
+            if (NULL != dst) {
+                const uint16_t dist = (uint16_t)(bestDist - 1);
+                const uint16_t len = extended ? 0x0F : (uint16_t)(bestLen - c_MinMatch);
+                dst[flagsIndex] = (uint8_t)(dst[flagsIndex] | (1 << flag));
+                dst[out] = (uint8_t)dist;
+                dst[out+1] = (uint8_t)(((dist >> 8) << 4) | len);
+                if (extended) {
+                    dst[out+2] = (uint8_t)(bestLen - c_ExtendedMatch);
+                }
+            }
+            out = (uint16_t)(out + refSize);
+            pos = (uint16_t)(pos + bestLen);
+        } else {
+            // Literal
+            if (out >= dstSize) {
+                return false;
+            }
+            if (NULL != dst) {
+                dst[out] = src[pos];
+            }
+            out++;
+            pos++;
+        }
+        flag++;
+    }
+    encodedSize = out;
+    return true;
+}
+
+bool EmPersistentLz::Decode(const uint8_t* src, 
+                            uint16_t size, 
+                            uint8_t* dst, 
+                            uint16_t dstSize,
+                            uint16_t& decodedSize) {
+    uint16_t in = 0;
+    uint16_t out = 0;
+    while (in < size) {
+        const uint8_t flags = src[in++];
+        for (uint8_t flag=0; flag < 8 && in < size; flag++) {
+            if (0 == (flags & (1 << flag))) {
+                // Literal
+                if (out >= dstSize) {
+                    return false;
+                }
+                dst[out++] = src[in++];
+                continue;
+            }
+            // Back reference
+            if (in + 2 > size) {
+                return false;
+            }
+            const uint16_t dist = (uint16_t)((src[in] | ((src[in+1] >> 4) << 8)) + 1);
+            uint16_t len = (uint16_t)((src[in+1] & 0x0F) + c_MinMatch);
+            in = (uint16_t)(in + 2);
+            if (len == c_ExtendedMatch) {
+                if (in >= size) {
+                    return false;
+                }
+                len = (uint16_t)(len + src[in++]);
+            }
+            if (dist > out || out + len > dstSize) {
+                return false;
+            }
+            // NOTE: byte by byte copy since the match may overlap the output
+            for (uint16_t i=0; i < len; i++, out++) {
+                dst[out] = dst[out - dist];
+            }
+        }
+    }
+    decodedSize = out;
+    return true;
+}
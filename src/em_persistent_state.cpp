@@ -1,9 +1,59 @@
 #include "Arduino.h"
 #include "em_persistent_state.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 const EmPersistentId EmPersistentState::c_HeaderId = EmPersistentId("#>!"); 
 const EmPersistentId EmPersistentState::c_FooterId = EmPersistentId("#<!");
+const EmPersistentId EmPersistentState::c_DeletedId = EmPersistentId('\0', '\0', '\0');
+const EmPersistentId EmPersistentState::c_ErasedId = EmPersistentId('\xFF', '\xFF', '\xFF');
+const EmPersistentId EmPersistentState::c_SlackId = EmPersistentId("#~!");
+const EmPersistentId EmPersistentState::c_NamespaceId = EmPersistentId("#{!");
+const EmPersistentId EmPersistentState::c_MapId = EmPersistentId("#[!");
+const EmPersistentId EmPersistentState::c_SeriesId = EmPersistentId("#(!");
+const EmPersistentId EmPersistentState::c_SegmentId = EmPersistentId("#|!");
+const EmPersistentId EmPersistentState::c_TreeId = EmPersistentId("#^!");
+const EmPersistentId EmPersistentState::c_HashIndexId = EmPersistentId("#=!");
+
+#ifndef EM_PS_STATIC_ONLY
+  //--------------------------------------------------
+ // EmPersistentAllocator class implementation   
+//--------------------------------------------------
+EmPersistentAllocator::AllocFunc EmPersistentAllocator::s_AllocFunc = EM_PS_ALLOC_FUNC;
+EmPersistentAllocator::FreeFunc EmPersistentAllocator::s_FreeFunc = EM_PS_FREE_FUNC;
+uint16_t EmPersistentAllocator::s_Allocations = 0;
+
+bool EmPersistentAllocator::Set(AllocFunc allocFunc, FreeFunc freeFunc) {
+    if (NULL == allocFunc || NULL == freeFunc || 0 != s_Allocations) {
+        // Memory allocated by current hooks cannot be freed by new ones!
+        return false;
+    }
+    s_AllocFunc = allocFunc;
+    s_FreeFunc = freeFunc;
+    return true;
+}
+
+void* EmPersistentAllocator::Alloc(size_t size) {
+    void* ptr = s_AllocFunc(size);
+    if (NULL != ptr) {
+        s_Allocations++;
+    }
+    return ptr;
+}
+
+void EmPersistentAllocator::Free(void* ptr) {
+    if (NULL == ptr) {
+        return;
+    }
+    s_FreeFunc(ptr);
+    s_Allocations--;
+}
+#endif // EM_PS_STATIC_ONLY
 
   //--------------------------------------------------
  // EmPersistentState class implementation   
@@ -12,25 +62,68 @@ EmPersistentState::EmPersistentState(EmLogLevel logLevel,
                                      ps_address_t beginIndex,
                                      ps_address_t endIndex)
   : EmLog("PS", logLevel),
+    m_pMedia(NULL),
+    m_BeginIndex(beginIndex),
+    m_EndIndex(endIndex),
+    m_NextPvAddress(0),
+    m_DeletedBytes(0),
+    m_SlackBytes(0),
+    m_pIndex(NULL) {
+#ifdef EM_PS_WCET
+    _wcetReset();
+#endif
+    _setRange((ps_address_t)EEPROM.begin(), (ps_address_t)EEPROM.end());
+}
+
+EmPersistentState::EmPersistentState(EmPersistentMedia& media,
+                                     EmLogLevel logLevel, 
+                                     ps_address_t beginIndex,
+                                     ps_address_t endIndex)
+  : EmLog("PS", logLevel),
+    m_pMedia(&media),
     m_BeginIndex(beginIndex),
     m_EndIndex(endIndex),
-    m_NextPvAddress(0) {
-    if ((int)m_BeginIndex >= EEPROM.end()) {
-        m_BeginIndex = EEPROM.begin();
+    m_NextPvAddress(0),
+    m_DeletedBytes(0),
+    m_SlackBytes(0),
+    m_pIndex(NULL) {
+#ifdef EM_PS_WCET
+    _wcetReset();
+#endif
+    if (0 == m_EndIndex) {
+        m_EndIndex = media.End();
+    }
+    _setRange(media.Begin(), media.End());
+}
+
+void EmPersistentState::_setRange(ps_address_t mediaBegin, ps_address_t mediaEnd) {
+    if (m_BeginIndex >= mediaEnd || m_BeginIndex < mediaBegin) {
+        m_BeginIndex = mediaBegin;
     }
-    if ((int)m_EndIndex > EEPROM.end()) {
-        m_EndIndex = EEPROM.end();
+    if (m_EndIndex > mediaEnd) {
+        m_EndIndex = mediaEnd;
     }
-    if (c_MinSize > (m_EndIndex - m_BeginIndex)) {
+    if (m_EndIndex < m_BeginIndex || c_MinSize > (m_EndIndex - m_BeginIndex)) {
         // TODO: could improve this by setting only a new begin or a new end
-        m_BeginIndex = EEPROM.begin();
-        m_EndIndex = EEPROM.end();
+        m_BeginIndex = mediaBegin;
+        m_EndIndex = mediaEnd;
     }
+    // Records start at write granularity boundaries (see 'EM_PS_WRITE_ALIGN')
+    m_BeginIndex = (ps_address_t)EmPersistentLayout::Aligned(m_BeginIndex);
 }
 
 int EmPersistentState::Init() {
+    uint16_t foundValues = 0;
+    return _init(NULL, foundValues);
+}
+
+int EmPersistentState::_init(const EmPersistentValueRegistry* pValues, 
+                             uint16_t& foundValues) {
     // Reset the last addresses to none (i.e. list not initialized)
     m_NextPvAddress = 0;
+    // A compaction may move the index and the values (see 'EmPersistentHashIndex::Open')
+    m_pIndex = NULL;
+    foundValues = 0;
     
     // Find start header
     EmPersistentId id;
@@ -40,32 +133,60 @@ int EmPersistentState::Init() {
     }
     // Already initialized?
     if (id != c_HeaderId) {
-        // Write the PS header
-        if (!c_HeaderId._store(*this, m_BeginIndex)) {
+        // Write the PS header & footer
+        if (!_clear()) {
             LogError(F("Init failed by storing header!"));      
             return -1;
         }
-        // Write the PS footer
-        if (!c_FooterId._store(*this, _firstPvAddress())) {
-            LogError(F("Init failed by storing footer!"));      
-            return -1;
-        }
+    }
+    // Warn about registry IDs collisions (e.g. two long IDs having same hash)
+    // NOTE: the first registry value gets the stored one
+    if (NULL != pValues) {
+        pValues->HasCollisions(*this);
+    }
+    // Reset values addresses (i.e. not stored yet)
+    const bool sorted = NULL != pValues && pValues->IsSorted();
+    for (uint16_t i=0; NULL != pValues && i < pValues->Count(); i++) {
+        (*pValues)[i]->m_Address = 0;
     }
     // Set the next PS address (i.e. the one after the last stored value)
     int count = 0;
+#ifdef EM_PS_WCET
+    m_IndexCount = 0;
+#endif
     m_NextPvAddress = _firstPvAddress();
     EmPersistentId psId;
     ps_size_t psSize = 0;
-    while (_readNext(m_NextPvAddress, psId, psSize)) {
+    m_DeletedBytes = 0;
+    m_SlackBytes = 0;
+    while (_readNext(m_NextPvAddress, psId, psSize, &m_DeletedBytes, &m_SlackBytes)) {
+        // NOTE: skipped records (e.g. deleted ones) are preceding the value record
+        const ps_address_t address = (ps_address_t)(m_NextPvAddress - EmPersistentLayout::HeaderSize());
+        // Assign the stored value to the matching registry value (first match only!)
+        EmPersistentValueBase* pValue = NULL == pValues ? NULL :
+                                        pValues->Find(psId, psSize, sorted);
+        if (NULL != pValue && !pValue->IsStored() &&
+            _readBytes(m_NextPvAddress, (uint8_t*)pValue->m_pValue, psSize)) {
+            pValue->m_Address = address;
+            foundValues++;
+        }
+#ifdef EM_PS_WCET
+        if (!_indexSet(psId, psSize, address)) {
+            LogError(F("Init failed by index full (see 'EM_PS_WCET_INDEX_SIZE')!"));
+            m_NextPvAddress = 0;
+            return -1;
+        }
+#endif
         // Move index to next PS item
         // NOTE: avoid conversion warning using += operator 
-        m_NextPvAddress = (ps_address_t)(m_NextPvAddress + psSize);
+        m_NextPvAddress = (ps_address_t)(m_NextPvAddress + EmPersistentLayout::Aligned(psSize));
         count++;
     }
     LogInfo(F("Init succeeded"));      
     return count;
 }
 
+#ifndef EM_PS_STATIC_ONLY
 int EmPersistentState::Init(const EmPersistentValueList& values,
                              bool removeUnusedValues) {
     // Check initialization
@@ -82,24 +203,89 @@ int EmPersistentState::Init(const EmPersistentValueList& values,
         }
     }
     // Set new values into PS
-    const bool somethingToDelete = countItems > foundItems;
+    const bool somethingToDelete = countItems > foundItems || m_DeletedBytes > 0;
     if (removeUnusedValues && somethingToDelete) {
         // Write user values from beginning of PS by overwriting old/unused ones
+        // NOTE: the reserved bytes are kept at the PS end
+        const ps_size_t slackBytes = m_SlackBytes;
+        m_SlackBytes = 0;
         m_NextPvAddress = _firstPvAddress();
+#ifdef EM_PS_WCET
+        m_IndexCount = 0;
+#endif
+        if (_isFlash()) {
+            Clear();
+        } else {
+            _moveContainers();
+        }
         while (values.Iterate(it)) {
-            _appendValue(it);
+            it.Item()->m_Address = 0;
+            _appendNotDefault(it);
         }        
+        if (slackBytes > 0) {
+            Reserve(slackBytes);
+        }
     } else {
         // Get new values and append them to PS
         while (values.Iterate(it)) {
             if (!it.Item()->IsStored()) {
-                _appendValue(it);
+                _appendNotDefault(it);
+            }
+        }        
+    }
+    return countItems;
+}
+#endif // EM_PS_STATIC_ONLY
+
+int EmPersistentState::Init(const EmPersistentValueRegistry& values,
+                            bool removeUnusedValues) {
+    // Check initialization and assign already stored values
+    uint16_t foundItems = 0;
+    const int countItems = _init(&values, foundItems);
+    if (countItems < 0) {
+        return countItems;
+    }
+    // Set new values into PS
+    const bool somethingToDelete = countItems > foundItems || m_DeletedBytes > 0;
+    if (removeUnusedValues && somethingToDelete) {
+        // Write user values from beginning of PS by overwriting old/unused ones
+        // NOTE: the reserved bytes are kept at the PS end
+        const ps_size_t slackBytes = m_SlackBytes;
+        m_SlackBytes = 0;
+        m_NextPvAddress = _firstPvAddress();
+#ifdef EM_PS_WCET
+        m_IndexCount = 0;
+#endif
+        if (_isFlash()) {
+            Clear();
+        } else {
+            _moveContainers();
+        }
+        for (uint16_t i=0; i < values.Count(); i++) {
+            values[i]->m_Address = 0;
+            _appendNotDefault(values[i]);
+        }        
+        if (slackBytes > 0) {
+            Reserve(slackBytes);
+        }
+    } else {
+        // Get new values and append them to PS
+        for (uint16_t i=0; i < values.Count(); i++) {
+            if (!values[i]->IsStored()) {
+                _appendNotDefault(values[i]);
             }
         }        
     }
     return countItems;
 }
 
+int EmPersistentState::Init(EmPersistentValueBase* const values[], 
+                            uint16_t count, 
+                            bool removeUnusedValues) {
+    return Init(EmPersistentValueRegistry(values, count), removeUnusedValues);
+}
+
+#ifndef EM_PS_STATIC_ONLY
 int EmPersistentState::Load(EmPersistentValueList& values) {
     // Check initialization
     if (!_isInitialized(true)) {
@@ -119,6 +305,7 @@ int EmPersistentState::Load(EmPersistentValueList& values) {
     
     return count;
 }
+#endif // EM_PS_STATIC_ONLY
 
 int EmPersistentState::Count() {
     // Check initialization
@@ -134,11 +321,12 @@ int EmPersistentState::Count() {
         count++;
         // Move index to next PS item
         // NOTE: avoid conversion warning using += operator 
-        index = (ps_address_t)(index + psSize);
+        index = (ps_address_t)(index + EmPersistentLayout::Aligned(psSize));
     }
     return count;
 }
 
+#ifndef EM_PS_STATIC_ONLY
 bool EmPersistentState::Iterate(EmPersistentValueIterator& iterator) {
     // Check initialization
     if (!_isInitialized(true)) {
@@ -161,18 +349,188 @@ bool EmPersistentState::Iterate(EmPersistentValueIterator& iterator) {
     iterator._setItem(_createNext(index));
     return NULL != iterator.Item();
 }
+#endif // EM_PS_STATIC_ONLY
+
+bool EmPersistentState::Stats(EmPersistentStats& stats) {
+    memset(&stats, 0, sizeof(stats));
+    // Check initialization
+    if (!_isInitialized(true)) {
+        return false;
+    }
+    ps_address_t index = _firstPvAddress();
+    EmPersistentId psId;
+    ps_size_t psSize = 0;
+    while (_readNext(index, psId, psSize, &stats.deletedBytes, &stats.slackBytes)) {
+        stats.values++;
+        stats.valueBytes = (ps_size_t)(stats.valueBytes + psSize);
+        stats.paddingBytes = (ps_size_t)(stats.paddingBytes + EmPersistentLayout::Padding(psSize));
+        // Move index to next PS item
+        // NOTE: avoid conversion warning using += operator 
+        index = (ps_address_t)(index + EmPersistentLayout::Aligned(psSize));
+    }
+    // PS header & footer plus values id & size
+    const ps_size_t idSize = EmPersistentLayout::Aligned(EmPersistentId::c_MaxLen);
+    stats.headerBytes = (ps_size_t)(2*EmPersistentId::c_MaxLen + stats.values*
+                                    (EmPersistentId::c_MaxLen + sizeof(ps_size_t)));
+    stats.paddingBytes = (ps_size_t)(stats.paddingBytes + 2*(idSize - EmPersistentId::c_MaxLen));
+    // NOTE: the last PS byte is never used (see '_indexCheck')
+    const ps_address_t usedEnd = (ps_address_t)(index + idSize);
+    stats.freeBytes = usedEnd < m_EndIndex ? (ps_size_t)(m_EndIndex - usedEnd - 1) : 0;
+    return true;
+}
+
+bool EmPersistentState::Iterate(EmPersistentValueView& view) {
+    // Check initialization
+    if (!_isInitialized(true)) {
+        return false;
+    }
+    // View reached the end?
+    if (view.EndReached()) {
+        return false;
+    }
+    // Get the next required PV address
+    ps_address_t index = 0;
+    if (0 == view.Address()) {
+        // First address
+        index = _firstPvAddress();
+    } else {
+        // Go to next address
+        index = view._nextPvAddress();
+    }
+    // Read next item header from PS (i.e. skipping deleted values and containers)
+    if (!_readNext(index, view.m_Id, view.m_Size)) {
+        view.m_EndReached = true;
+        return false;
+    }
+    view.m_pPs = this;
+    view.m_Address = (ps_address_t)(index - EmPersistentLayout::HeaderSize());
+    return true;
+}
+
+bool EmPersistentState::Iterate(EmPersistentValueView& view, const char* prefix) {
+    // The ids range starting with 'prefix' chars (i.e. any following chars)
+    uint32_t first = 0;
+    uint32_t last = 0;
+    uint8_t i = 0;
+    for (; i < EmPersistentId::c_MaxLen && 0 != prefix[i]; i++) {
+        first = (first << 8) | (uint8_t)prefix[i];
+        last = (last << 8) | (uint8_t)prefix[i];
+    }
+    for (; i < EmPersistentId::c_MaxLen; i++) {
+        first = first << 8;
+        last = (last << 8) | 0xFF;
+    }
+    return _iterate(view, first, last);
+}
+
+bool EmPersistentState::Iterate(EmPersistentValueView& view, 
+                                const EmPersistentId& first, 
+                                const EmPersistentId& last) {
+    return _iterate(view, first.OrderKey(), last.OrderKey());
+}
+
+bool EmPersistentState::_iterate(EmPersistentValueView& view, uint32_t first, uint32_t last) {
+    if (NULL != m_pIndex && m_pIndex->_isOrdered() && _isInitialized(true)) {
+        if (view.EndReached()) {
+            return false;
+        }
+        // Ordered index: seek the entry after the view one (i.e. ids order)
+        uint32_t key = first;
+        ps_size_t size = 0;
+        bool inclusive = true;
+        if (0 != view.Address()) {
+            key = view.Id().OrderKey();
+            size = view.Size();
+            inclusive = false;
+        }
+        uint32_t foundKey = 0;
+        ps_size_t foundSize = 0;
+        ps_address_t address = 0;
+        while (m_pIndex->_seek(key, size, inclusive, foundKey, foundSize, address) && 
+               foundKey <= last) {
+            // The record is checked (i.e. skip outdated entries)
+            if (_readRecord(address, view.m_Id, view.m_Size) && 
+                foundKey == view.m_Id.OrderKey() && foundSize == view.m_Size) {
+                view.m_pPs = this;
+                view.m_Address = address;
+                return true;
+            }
+            key = foundKey;
+            size = foundSize;
+            inclusive = false;
+        }
+        view.m_EndReached = true;
+        return false;
+    }
+    // NOTE: only records headers are read, the matching value is read by 'view.Read'
+    while (Iterate(view)) {
+        const uint32_t key = view.Id().OrderKey();
+        if (key >= first && key <= last) {
+            return true;
+        }
+    }
+    return false;
+}
 
 bool EmPersistentState::Clear() {
-    if (c_HeaderId._store(*this, m_BeginIndex) && 
-        c_FooterId._store(*this, _firstPvAddress())) {
+    m_pIndex = NULL;
+    if (_clear()) {
         m_NextPvAddress = _firstPvAddress();
+        m_DeletedBytes = 0;
+        m_SlackBytes = 0;
+#ifdef EM_PS_WCET
+        m_IndexCount = 0;
+#endif
         return true;
     }
     LogError(F("Clear failed!"));      
     return false;
 }
 
-bool EmPersistentState::Add(EmPersistentValueBase& value){
+bool EmPersistentState::_clear() {
+    if (_isFlash()) {
+        // Flash: erase the whole PS (i.e. the erased id is the footer)
+        return m_pMedia->Erase(m_BeginIndex, m_EndIndex) && 
+               c_HeaderId._store(*this, m_BeginIndex);
+    }
+    return c_HeaderId._store(*this, m_BeginIndex) && 
+           c_FooterId._store(*this, _firstPvAddress());
+}
+
+bool EmPersistentState::FactoryReset(const EmPersistentValueRegistry& values) {
+    // Check initialization
+    if (!_isInitialized(true)) {
+        return false;
+    }
+    bool res = true;
+    for (uint16_t i=0; i < values.Count(); i++) {
+        EmPersistentValueBase* pValue = values[i];
+        if (!pValue->_hasDefault()) {
+            // No factory value: kept as is
+            continue;
+        }
+#ifdef EM_PS_WCET
+        _cancelValue(pValue);
+#endif
+        // Delete the stored record (i.e. removed by the next compaction)
+        ps_address_t index = _firstPvAddress();
+        if (_findMatch(index, pValue->m_Id, pValue->m_BufferSize)) {
+            const ps_address_t address = (ps_address_t)(index - EmPersistentLayout::HeaderSize());
+#ifdef EM_PS_WCET
+            _indexDrop(pValue->m_Id, pValue->m_BufferSize);
+#endif
+            res = _deleteRecord(address, pValue->m_BufferSize) && res;
+        }
+        pValue->m_Address = 0;
+        pValue->_setDefault();
+    }
+    return res;
+}
+
+bool EmPersistentState::Add(EmPersistentValueBase& value, ps_size_t slack, bool replace){
+#ifdef EM_PS_WCET
+    m_Accesses = 0;
+#endif
     // Check initialization
     if (!_isInitialized(true)) {
         return false;
@@ -182,11 +540,72 @@ bool EmPersistentState::Add(EmPersistentValueBase& value){
         // Value already in PS
         return true; 
     }
+#ifdef EM_PS_WCET
+    // Record and footer bytes read & write
+    // NOTE: 'Init' appends and flash moves (see 'Process') are not bounded
+    if (!_wcetCheck((ps_size_t)(2*(EmPersistentLayout::RecordSize(value.m_BufferSize) + 
+                                   EmPersistentId::c_MaxLen)))) {
+        return false;
+    }
+#endif
     // Not found, append a new value to PS
-    return _appendValue(&value);
+    const ps_address_t endAddress = m_NextPvAddress;
+    if (!_appendNotDefault(&value, replace)) {
+        return false;
+    }
+    // Reserve the growth slack unless value took an already reserved space
+    if (0 == slack || (value.IsStored() && value.m_Address != endAddress)) {
+        return true;
+    }
+    return Reserve(slack);
+}
+
+bool EmPersistentState::Reserve(ps_size_t bytes) {
+    // Check initialization
+    if (!_isInitialized(true)) {
+        return false;
+    }
+    if (_isFlash()) {
+        LogError(F("Reserve not supported by flash media!"));      
+        return false;
+    }
+    // The reserved space is a record (i.e. at least its header)
+    const ps_size_t recordSize = EmPersistentLayout::Aligned(bytes) < EmPersistentLayout::HeaderSize() ? 
+                                 EmPersistentLayout::HeaderSize() : EmPersistentLayout::Aligned(bytes);
+    const ps_size_t slackSize = (ps_size_t)(recordSize - EmPersistentLayout::HeaderSize());
+    const ps_address_t footerAddress = (ps_address_t)(m_NextPvAddress + recordSize);
+#if EM_PS_SEGMENT_SIZE > 0
+    // Old segment markers within the reserved space (i.e. left by a compaction) 
+    // are erased, a marker overlapping the footer cannot match
+    const ps_address_t offset = (ps_address_t)(m_NextPvAddress - m_BeginIndex);
+    for (ps_address_t marker = (ps_address_t)(m_NextPvAddress - offset % EM_PS_SEGMENT_SIZE + EM_PS_SEGMENT_SIZE);
+         marker + EmPersistentId::c_MaxLen <= footerAddress;
+         marker = (ps_address_t)(marker + EM_PS_SEGMENT_SIZE)) {
+        if (!_indexCheck(marker, EmPersistentId::c_MaxLen) ||
+            !c_DeletedId._store(*this, marker)) {
+            LogError(F("Reserve failed!"));      
+            return false;
+        }
+    }
+#endif
+    // Move the footer first, then overwrite the old one with the slack header
+    if (!_indexCheck(footerAddress, EmPersistentId::c_MaxLen) ||
+        !c_FooterId._store(*this, footerAddress) ||
+        !_updateSize((ps_address_t)(m_NextPvAddress + EmPersistentId::c_MaxLen), slackSize) ||
+        !c_SlackId._store(*this, m_NextPvAddress)) {
+        LogError(F("Reserve failed!"));      
+        return false;
+    }
+    m_NextPvAddress = footerAddress;
+    m_SlackBytes = (ps_size_t)(m_SlackBytes + recordSize);
+    _indexAppended(NULL);
+    return true;
 }
 
 bool EmPersistentState::Find(EmPersistentValueBase& value){
+#ifdef EM_PS_WCET
+    m_Accesses = 0;
+#endif
     // Check initialization
     if (!_isInitialized(true)) {
         return false;
@@ -196,8 +615,13 @@ bool EmPersistentState::Find(EmPersistentValueBase& value){
     if (!_findMatch(index, value.Id(), value.Size())) {
         return false;
     }
+#ifdef EM_PS_WCET
+    if (!_wcetCheck(value.Size())) {
+        return false;
+    }
+#endif
     // Set value PS's address
-    value.m_Address = (ps_address_t)(index - EmPersistentId::c_MaxLen - (ps_address_t)sizeof(ps_size_t));
+    value.m_Address = (ps_address_t)(index - EmPersistentLayout::HeaderSize());
     // Read its value
     if (!_readBytes(index, (uint8_t*)value.m_pValue, value.Size())) {
         return false;
@@ -208,12 +632,38 @@ bool EmPersistentState::Find(EmPersistentValueBase& value){
 bool EmPersistentState::_findMatch(ps_address_t& index, 
                                    const EmPersistentId& id,
                                    ps_size_t size) const {
+#ifdef EM_PS_WCET
+    // Bounded lookup: the index holds all stored values
+    const uint32_t key = id._key();
+    for (uint16_t i=0; i < m_IndexCount; i++) {
+        if (key == m_Index[i].key && size == m_Index[i].size) {
+            index = (ps_address_t)(m_Index[i].address + EmPersistentLayout::HeaderSize());
+            return true;
+        }
+    }
+    return false;
+#else
     EmPersistentId psId;
     ps_size_t psSize = 0;
+    if (NULL != m_pIndex) {
+        // On media index lookup, the record is checked (i.e. chain scan if outdated)
+        ps_address_t address = 0;
+        bool complete = false;
+        if (m_pIndex->_lookup(id, size, address, complete)) {
+            if (_readRecord(address, psId, psSize) && 
+                EmPersistentValueBase::_match(id, psId, size, psSize)) {
+                index = (ps_address_t)(address + EmPersistentLayout::HeaderSize());
+                return true;
+            }
+        } else if (complete) {
+            return false;
+        }
+        psSize = 0;
+    }
     while (!EmPersistentValueBase::_match(id, psId, size, psSize)) {
         // Move index to next PS item
         // NOTE: avoid conversion warning using += operator 
-        index = (ps_address_t)(index + psSize);
+        index = (ps_address_t)(index + EmPersistentLayout::Aligned(psSize));
         // Read next PS id & size
         if (!_readNext(index, psId, psSize)) {
             return false;
@@ -221,68 +671,162 @@ bool EmPersistentState::_findMatch(ps_address_t& index,
     }
     // Item found
     return true;
+#endif
 }                                    
 
 bool EmPersistentState::_readNext(ps_address_t& index, 
                                   EmPersistentId& id,
-                                  ps_size_t& size) const {
-    // Read PS id
-    if (!id._read(*this, index)) {
-        // Read id failed
-        return false;
+                                  ps_size_t& size,
+                                  ps_size_t* pDeletedBytes,
+                                  ps_size_t* pSlackBytes) const {
+    while (_readRecord(index, id, size)) {
+        if (id == c_DeletedId) {
+            // Deleted value (i.e. moved somewhere else): skip it
+            if (NULL != pDeletedBytes) {
+                *pDeletedBytes = (ps_size_t)(*pDeletedBytes + EmPersistentLayout::RecordSize(size));
+            }
+        } else if (id == c_SlackId) {
+            // Reserved space: skip it
+            if (NULL != pSlackBytes) {
+                *pSlackBytes = (ps_size_t)(*pSlackBytes + EmPersistentLayout::RecordSize(size));
+            }
+        } else if (id == c_SegmentId) {
+            // Segment marker or gap: skip it
+        } else if (!_isContainer(id)) {
+            // Move to value index
+            index = (ps_address_t)(index + EmPersistentLayout::HeaderSize());
+            return true;
+        }
+        // NOTE: namespaces and maps are skipped in one jump
+        index = (ps_address_t)(index + EmPersistentLayout::RecordSize(size));
     }
-    // PS termination?
-    if (id == c_FooterId) {
-        // End of persistent state
+    return false;
+}
+
+#if EM_PS_SEGMENT_SIZE > 0
+uint16_t EmPersistentState::Segments() const {
+    return (uint16_t)((m_EndIndex - m_BeginIndex + EM_PS_SEGMENT_SIZE - 1) / EM_PS_SEGMENT_SIZE);
+}
+
+bool EmPersistentState::ScanSegment(uint16_t segment, EmPersistentSegmentScan& scan) const {
+    memset(&scan, 0, sizeof(scan));
+    if (!_isInitialized(true) || segment >= Segments()) {
         return false;
     }
-    // Read PS size
-    // NOTE: avoid conversion warning using += operator 
-    index = (ps_address_t)(index + EmPersistentId::c_MaxLen);
-    if (!_readBytes(index, (uint8_t*)&size, sizeof(size))) {
-        // Read size failed
+    // The first segment starts after the PS header
+    const ps_address_t start = (ps_address_t)(m_BeginIndex + segment*EM_PS_SEGMENT_SIZE);
+    ps_address_t index = 0 == segment ? _firstPvAddress() : start;
+    EmPersistentId id;
+    ps_size_t size = 0;
+    if (segment > 0 && (start >= m_NextPvAddress ||
+                        !_readRecord(index, id, size) || id != c_SegmentId)) {
+        // Within a record or after the PS end (i.e. old markers left by a compaction)
+        return true;
+    }
+    scan.marked = true;
+    while (_readRecord(index, id, size)) {
+        if (id == c_SegmentId && index > start && 0 == (index - m_BeginIndex) % EM_PS_SEGMENT_SIZE) {
+            // Next marked segment
+            break;
+        }
+        if (id != c_DeletedId && id != c_SlackId && id != c_SegmentId && !_isContainer(id)) {
+            scan.values++;
+        }
+        index = (ps_address_t)(index + EmPersistentLayout::RecordSize(size));
+    }
+    scan.end = index;
+    return true;
+}
+
+bool EmPersistentState::_markSegment(ps_size_t recordSize) {
+    if (_isFlash()) {
+        // NOTE: segment gaps are reserved space, not supported by flash media 
+        return true;
+    }
+    const ps_size_t headerSize = EmPersistentLayout::HeaderSize();
+    const ps_address_t offset = (ps_address_t)(m_NextPvAddress - m_BeginIndex);
+    ps_address_t marker = (ps_address_t)(m_BeginIndex + offset - offset % EM_PS_SEGMENT_SIZE);
+    if (marker != m_NextPvAddress) {
+        marker = (ps_address_t)(marker + EM_PS_SEGMENT_SIZE);
+        const ps_size_t gap = (ps_size_t)(marker - m_NextPvAddress);
+        if (recordSize <= gap || gap < headerSize) {
+            // Not crossing or gap too small for a record (i.e. segment left unmarked)
+            return true;
+        }
+    } else if (m_NextPvAddress == m_BeginIndex) {
+        return true;
+    }
+    // Move the footer first, then write the marker and the gap header 
+    // NOTE: the gap is a segment record too (i.e. not reserved space reused 
+    //       by new values and kept by compaction)
+    const ps_address_t footerAddress = (ps_address_t)(marker + headerSize);
+    if (!_indexCheck(footerAddress, EmPersistentId::c_MaxLen) ||
+        !c_FooterId._store(*this, footerAddress) ||
+        !_updateSize((ps_address_t)(marker + EmPersistentId::c_MaxLen), 0) ||
+        !c_SegmentId._store(*this, marker)) {
         return false;
     }
-    // Move to value index
-    index = (ps_address_t)(index + sizeof(size));
+    if (marker != m_NextPvAddress) {
+        const ps_size_t gap = (ps_size_t)(marker - m_NextPvAddress);
+        if (!_updateSize((ps_address_t)(m_NextPvAddress + EmPersistentId::c_MaxLen), 
+                         (ps_size_t)(gap - headerSize)) ||
+            !c_SegmentId._store(*this, m_NextPvAddress)) {
+            return false;
+        }
+    }
+    m_NextPvAddress = footerAddress;
     return true;
 }
+#endif
 
-EmPersistentValueBase* EmPersistentState::_createNext(ps_address_t& index) const {
-    EmPersistentId id;
-    const ps_address_t address = index;
+bool EmPersistentState::_readRecord(ps_address_t index, 
+                                    EmPersistentId& id,
+                                    ps_size_t& size) const {
+    // Read PS id
     if (!id._read(*this, index)) {
         // Read id failed
-        return NULL;
+        return false;
     }
     // PS termination?
-    if (id == c_FooterId) {
+    if (id == c_FooterId || (id == c_ErasedId && _isFlash())) {
         // End of persistent state
-        return NULL;
+        return false;
     }
-    // Read the value size
+    // Read PS size
     // NOTE: avoid conversion warning using += operator 
-    index = (ps_address_t)(index + EmPersistentId::c_MaxLen);
-    ps_size_t size;
-    if (!_readBytes(index, (uint8_t*)&size, sizeof(size))) {
-        // Read size failed
+    return _readSize((ps_address_t)(index + EmPersistentId::c_MaxLen), size);
+}
+
+#ifndef EM_PS_STATIC_ONLY
+EmPersistentValueBase* EmPersistentState::_createNext(ps_address_t& index) {
+    EmPersistentId id;
+    ps_size_t size = 0;
+    if (!_readNext(index, id, size)) {
+        // Read failed or end of persistent state
         return NULL;
     }
+    // NOTE: the record address after the skipped deleted values and containers
+    const ps_address_t address = (ps_address_t)(index - EmPersistentLayout::HeaderSize());
     
     EmPersistentValueBase* pPv = NULL; 
-    // NOTE: avoid conversion warning using += operator 
-    index = (ps_address_t)(index + sizeof(size));
-    void* pValue = malloc(size);
+    void* pValue = EmPersistentAllocator::Alloc(size);
+    if (NULL == pValue) {
+        LogError(F("Value allocation failed!"));      
+        return NULL;
+    }
     if (_readBytes(index, (uint8_t*)pValue, size)) {
         // Read value succeeded: create new persistent value object
-        pPv = new EmPersistentValueBase(*this, id.m_Id, address, size, pValue);
-        index = (ps_address_t)(index + size);
+        pPv = new EmPersistentValueBase(*this, id, address, size, pValue);
+    }
+    if (NULL != pPv) {
+        index = (ps_address_t)(index + EmPersistentLayout::Aligned(size));
     } else {
-        // Read value failed: free allocated resources
-        free(pValue);    
+        // Read value or object allocation failed: free allocated resources
+        EmPersistentAllocator::Free(pValue);    
     }
     return pPv;
 }
+#endif // EM_PS_STATIC_ONLY
 
 bool EmPersistentState::_isInitialized(bool logError) const {
     if (0 == m_NextPvAddress) {
@@ -294,17 +838,185 @@ bool EmPersistentState::_isInitialized(bool logError) const {
     return true;
 }
 
-bool EmPersistentState::_appendValue(EmPersistentValueBase* pValue) {
+bool EmPersistentState::_appendValue(EmPersistentValueBase* pValue, bool replace) {
+    if (NULL == pValue->m_pValue) {
+        LogError(F("Cannot append a value without buffer!"));      
+        return false;
+    }
+    if (!pValue->m_Id.IsValid()) {
+        // i.e. it would be skipped as a deleted value
+        LogError(F("Cannot append a value having an empty ID!"));      
+        return false;
+    }
+#ifndef EM_PS_WCET
+    // Grow an older version in place (if replaced), use the reserved space 
+    // (see 'Reserve') only if the PS end is full (i.e. keep it for values growth)
+    // NOTE: not in WCET mode since the reserved space lookup is a chain scan
+    const bool endFits = (ps_address_t)(m_NextPvAddress + EmPersistentLayout::RecordSize(pValue->m_BufferSize) + 
+                                        EmPersistentId::c_MaxLen) < m_EndIndex;
+    if (m_SlackBytes > 0 && _placeInSlack(pValue, endFits, replace)) {
+        _indexAppended(pValue);
+        return true;
+    }
+#else
+    (void)replace;
+#endif
+#if EM_PS_SEGMENT_SIZE > 0
+    if (!_markSegment(EmPersistentLayout::RecordSize(pValue->m_BufferSize))) {
+        return false;
+    }
+#endif
     pValue->m_Address = m_NextPvAddress;
     // Store value into storage and update footer
-    if (pValue->_store() && c_FooterId._store(*this, pValue->_nextPvAddress())) {
+    // NOTE: flash media footer is the erased space following the last value
+    if (_indexCheck(pValue->_nextPvAddress(), EmPersistentId::c_MaxLen) &&
+        pValue->_store() && 
+        (_isFlash() || c_FooterId._store(*this, pValue->_nextPvAddress()))) {
         m_NextPvAddress = pValue->_nextPvAddress(); 
+#ifdef EM_PS_WCET
+        _indexSet(pValue->m_Id, pValue->m_BufferSize, pValue->m_Address);
+#endif
+        _indexAppended(pValue);
         return true;
     }
     pValue->m_Address = 0;
     return false;
 }
 
+bool EmPersistentState::_placeInSlack(EmPersistentValueBase* pValue, bool growOnly, bool replace) {
+    const ps_size_t needed = EmPersistentLayout::RecordSize(pValue->m_BufferSize);
+    ps_address_t index = _firstPvAddress();
+    ps_address_t freeAddress = 0;
+    ps_size_t freeSize = 0;
+    ps_size_t freeSlack = 0;
+    // The previous value record (i.e. a value older version followed by slack)
+    bool prevSameId = false;
+    ps_address_t prevAddress = 0;
+    ps_size_t prevRecordSize = 0;
+    EmPersistentId psId;
+    ps_size_t psSize = 0;
+    while (_readRecord(index, psId, psSize)) {
+        const ps_size_t recordSize = EmPersistentLayout::RecordSize(psSize);
+        if (psId == c_SlackId) {
+            // The space fits if fully used or if its remainder can hold a slack header
+            const ps_size_t grownSize = (ps_size_t)(prevRecordSize + recordSize);
+            if (prevSameId && (needed == grownSize || 
+                               needed + EmPersistentLayout::HeaderSize() <= grownSize)) {
+                // Grow the older version in place
+                freeAddress = prevAddress;
+                freeSize = grownSize;
+                freeSlack = recordSize;
+                break;
+            }
+            if (!growOnly && 0 == freeAddress && (needed == recordSize || 
+                                     needed + EmPersistentLayout::HeaderSize() <= recordSize)) {
+                freeAddress = index;
+                freeSize = recordSize;
+                freeSlack = recordSize;
+            }
+            prevSameId = false;
+        } else {
+            // NOTE: another size is another value unless explicitly replaced
+            prevSameId = replace && psId == pValue->m_Id && psSize != pValue->m_BufferSize;
+            prevAddress = index;
+            prevRecordSize = recordSize;
+        }
+        index = (ps_address_t)(index + recordSize);
+    }
+    if (0 == freeAddress) {
+        return false;
+    }
+    // Every step leaves a valid records chain (i.e. a reset loses the new 
+    // value but never loads a partially written one):
+    //  1. the older version (if growing it) becomes a slack merged with the 
+    //     following one
+    //  2. the remainder slack header (i.e. unreachable until the size changes)
+    //  3. the new size, then the value
+    //  4. the new id commits the record
+    if (freeSize != freeSlack) {
+        if (!c_SlackId._store(*this, freeAddress) ||
+            !_updateSize((ps_address_t)(freeAddress + EmPersistentId::c_MaxLen), 
+                         (ps_size_t)(freeSize - EmPersistentLayout::HeaderSize()))) {
+            return false;
+        }
+        m_SlackBytes = (ps_size_t)(m_SlackBytes + freeSize - freeSlack);
+        freeSlack = freeSize;
+    }
+    const ps_size_t remainder = (ps_size_t)(freeSize - needed);
+    if (remainder > 0) {
+        const ps_address_t slackAddress = (ps_address_t)(freeAddress + needed);
+        const ps_size_t slackSize = (ps_size_t)(remainder - EmPersistentLayout::HeaderSize());
+        if (!_updateSize((ps_address_t)(slackAddress + EmPersistentId::c_MaxLen), slackSize) ||
+            !c_SlackId._store(*this, slackAddress)) {
+            return false;
+        }
+    }
+    pValue->m_Address = freeAddress;
+    if (!_updateSize(pValue->_sizeAddress(), pValue->m_BufferSize) ||
+        !pValue->_writeValue() ||
+        !pValue->m_Id._store(*this, pValue->_idAddress())) {
+        pValue->m_Address = 0;
+        return false;
+    }
+    m_SlackBytes = (ps_size_t)(m_SlackBytes + remainder - freeSlack);
+    return true;
+}
+
+bool EmPersistentState::_updateValue(EmPersistentValueBase* pValue) {
+#ifdef EM_PS_WCET
+    // Bounded time: the value is written by 'Process'
+    return _deferValue(pValue);
+}
+
+bool EmPersistentState::_writeValue(EmPersistentValueBase* pValue) {
+#endif
+    const uint8_t* bytes = (const uint8_t*)pValue->m_pValue;
+    const ps_address_t index = pValue->_valueAddress();
+    if (!_isFlash() || _canProgram(index, bytes, pValue->m_BufferSize)) {
+        // Update in place
+        return _updateBytes(index, bytes, pValue->m_BufferSize);
+    }
+    // Flash: some bits must be set, move the value to the PS end and 
+    // delete the old one (i.e. setting its id to zeros clears bits only)
+    // NOTE: on power loss the old value is the first found one
+    const ps_address_t oldAddress = pValue->m_Address;
+    if (!_appendValue(pValue)) {
+        LogError(F("No space for moving value, compact the PS!"));      
+        pValue->m_Address = oldAddress;
+        return false;
+    }
+    m_DeletedBytes = (ps_size_t)(m_DeletedBytes + EmPersistentLayout::RecordSize(pValue->m_BufferSize));
+    return c_DeletedId._store(*this, oldAddress);
+}
+
+bool EmPersistentState::_updateValue(EmPersistentValueBase* pValue, ps_size_t offset, ps_size_t size) {
+#ifdef EM_PS_WCET
+    // Bounded time: the whole value is written by 'Process'
+    (void)offset;
+    (void)size;
+#else
+    const uint8_t* bytes = (const uint8_t*)pValue->m_pValue + offset;
+    const ps_address_t index = (ps_address_t)(pValue->_valueAddress() + offset);
+    if (!_isFlash() || _canProgram(index, bytes, size)) {
+        // Update in place the changed bytes only
+        return _updateBytes(index, bytes, size);
+    }
+#endif
+    return _updateValue(pValue);
+}
+
+bool EmPersistentState::_appendNotDefault(EmPersistentValueBase* pValue, bool replace) {
+    if (pValue->_isDefault()) {
+        // Default values are not stored
+        pValue->m_Address = 0;
+        return true;
+    }
+    if (!_isInitialized(true)) {
+        return false;
+    }
+    return _appendValue(pValue, replace);
+}
+
 bool EmPersistentState::_indexCheck(ps_address_t index, ps_size_t size) const {    
     bool res = index >= m_BeginIndex && (index+size) < m_EndIndex;
     if (!res) {
@@ -318,47 +1030,1608 @@ uint8_t EmPersistentState::_readByte(ps_address_t index) const {
     if (!_indexCheck(index, 1)) {
         return 0;
     }
-    return EEPROM.read(index);
+    return _mediaRead(index);
 }
 
 bool EmPersistentState::_readBytes(ps_address_t index, uint8_t* bytes, ps_size_t size) const {
     if (!_indexCheck(index, size)) {
         return false;
     }
+    if (NULL != m_pMedia) {
+        // One media block read (e.g. one bus transaction)
+#ifdef EM_PS_WCET
+        m_Accesses = (uint16_t)(m_Accesses + size);
+#endif
+        m_pMedia->ReadBlock(index, bytes, size);
+        return true;
+    }
     for(ps_address_t i=0; i<size; i++) {
-        bytes[i] = EEPROM.read(index+i);
+        bytes[i] = _mediaRead((ps_address_t)(index+i));
     }
     return true;
 }
 
 bool EmPersistentState::_updateByte(ps_address_t index, uint8_t byte) const {
-    if (!_indexCheck(index, 1)) {
-        return false;
-    }
-    if (byte != EEPROM.read(index)) {
-        EEPROM.write(index, byte);
-    }
-    return true;
+    return _updateBytes(index, &byte, 1);
 }
 
 bool EmPersistentState::_updateBytes(ps_address_t index, const uint8_t* bytes, ps_size_t size) const {
     if (!_indexCheck(index, size)) {
         return false;
     }
+    if (_isFlash() && !_canProgram(index, bytes, size)) {
+        LogError<50>("Flash cannot set bits at: %d", index);
+        return false;
+    }
     for(ps_address_t i=0; i<size; i++) {
-        if (bytes[i] != EEPROM.read(index+i)) {
-            EEPROM.write(index+i, bytes[i]);
+        if (bytes[i] != _mediaRead((ps_address_t)(index+i))) {
+            _mediaWrite((ps_address_t)(index+i), bytes[i]);
         }
     }
     return true;
 }
 
-inline ps_address_t EmPersistentState::_firstPvAddress() const {
-    return (ps_address_t)(m_BeginIndex + EmPersistentId::c_MaxLen);
+bool EmPersistentState::_readSize(ps_address_t index, ps_size_t& size) const {
+    uint8_t bytes[sizeof(ps_size_t)];
+    if (!_readBytes(index, bytes, sizeof(bytes))) {
+        return false;
+    }
+#ifdef EM_PS_NATIVE_ENDIAN
+    memcpy(&size, bytes, sizeof(size));
+#else
+    // NOTE: compilers reduce it to a plain load on little endian targets
+    size = (ps_size_t)(bytes[0] | (bytes[1] << 8));
+#endif
+    return true;
 }
 
-  //--------------------------------------------------
- // EmPersistentId class implementation   
+bool EmPersistentState::_updateSize(ps_address_t index, ps_size_t size) const {
+    uint8_t bytes[sizeof(ps_size_t)];
+#ifdef EM_PS_NATIVE_ENDIAN
+    memcpy(bytes, &size, sizeof(size));
+#else
+    bytes[0] = (uint8_t)size;
+    bytes[1] = (uint8_t)(size >> 8);
+#endif
+    return _updateBytes(index, bytes, sizeof(bytes));
+}
+
+bool EmPersistentState::_canProgram(ps_address_t index, const uint8_t* bytes, ps_size_t size) const {
+    for(ps_address_t i=0; i<size; i++) {
+        // Only bits clearing allowed (i.e. new = old & new)
+        if (bytes[i] != (_mediaRead((ps_address_t)(index+i)) & bytes[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint8_t EmPersistentState::_mediaRead(ps_address_t index) const {
+#ifdef EM_PS_WCET
+    m_Accesses++;
+#endif
+    return NULL == m_pMedia ? EEPROM.read(index) : m_pMedia->Read(index);
+}
+
+void EmPersistentState::_mediaWrite(ps_address_t index, uint8_t byte) const {
+#ifdef EM_PS_WCET
+    m_Accesses++;
+#endif
+    if (NULL == m_pMedia) {
+        EEPROM.write(index, byte);
+    } else {
+        m_pMedia->Write(index, byte);
+    }
+}
+
+#ifdef EM_PS_WCET
+bool EmPersistentState::Process() {
+    m_Accesses = 0;
+    // Skip values not stored anymore (e.g. after a 'FactoryReset')
+    while (m_QueueCount > 0 && !m_pQueue[0]->IsStored()) {
+        _dequeue();
+    }
+    if (0 == m_QueueCount) {
+        return false;
+    }
+    EmPersistentValueBase* pValue = m_pQueue[0];
+    if (_isFlash() && 0 == m_QueueOffset) {
+        // NOTE: flash value moves are done as a whole
+        if (!_canProgram(pValue->_valueAddress(), 
+                         (const uint8_t*)pValue->m_pValue, 
+                         pValue->m_BufferSize)) {
+            if (!_writeValue(pValue)) {
+                // Kept queued (e.g. written after a compaction)
+                return false;
+            }
+            _dequeue();
+            return true;
+        }
+    }
+    // Write next value chunk
+    const ps_size_t chunk = (ps_size_t)MIN(c_WcetChunkSize, 
+                                           pValue->m_BufferSize - m_QueueOffset);
+    if (!_updateBytes((ps_address_t)(pValue->_valueAddress() + m_QueueOffset), 
+                      (const uint8_t*)pValue->m_pValue + m_QueueOffset, 
+                      chunk)) {
+        LogError(F("Deferred write failed!"));      
+        return false;
+    }
+    m_QueueOffset = (ps_size_t)(m_QueueOffset + chunk);
+    if (m_QueueOffset >= pValue->m_BufferSize) {
+        _dequeue();
+    }
+    return true;
+}
+
+void EmPersistentState::Flush() {
+    while (Process()) {
+    }
+}
+
+void EmPersistentState::_wcetReset() {
+    m_IndexCount = 0;
+    m_QueueCount = 0;
+    m_QueueOffset = 0;
+    m_Accesses = 0;
+}
+
+bool EmPersistentState::_wcetCheck(ps_size_t accesses) const {
+    if (accesses > c_WcetMaxAccesses) {
+        LogError<60>("Storage accesses exceed WCET limit: %d", accesses);
+        return false;
+    }
+    return true;
+}
+
+bool EmPersistentState::_indexSet(const EmPersistentId& id, 
+                                  ps_size_t size, 
+                                  ps_address_t address) {
+    const uint32_t key = id._key();
+    for (uint16_t i=0; i < m_IndexCount; i++) {
+        if (key == m_Index[i].key && size == m_Index[i].size) {
+            // Keep first stored value (i.e. same as the chain scan)
+            if (!_isFlash()) {
+                return true;
+            }
+            // Flash: value moved
+            m_Index[i].address = address;
+            return true;
+        }
+    }
+    if (m_IndexCount >= c_WcetIndexSize) {
+        return false;
+    }
+    m_Index[m_IndexCount].key = key;
+    m_Index[m_IndexCount].size = size;
+    m_Index[m_IndexCount].address = address;
+    m_IndexCount++;
+    return true;
+}
+
+void EmPersistentState::_indexDrop(const EmPersistentId& id, ps_size_t size) {
+    const uint32_t key = id._key();
+    for (uint16_t i=0; i < m_IndexCount; i++) {
+        if (key == m_Index[i].key && size == m_Index[i].size) {
+            // NOTE: entries order doesn't matter
+            m_IndexCount--;
+            m_Index[i] = m_Index[m_IndexCount];
+            return;
+        }
+    }
+}
+
+bool EmPersistentState::_deferValue(EmPersistentValueBase* pValue) {
+    for (uint8_t i=0; i < m_QueueCount; i++) {
+        if (pValue == m_pQueue[i]) {
+            if (0 == i) {
+                // Being written: restart it (i.e. written chunks may be changed)
+                m_QueueOffset = 0;
+            }
+            return true;
+        }
+    }
+    if (m_QueueCount >= c_WcetQueueSize) {
+        LogError(F("Deferred writes queue full (see 'EM_PS_WCET_QUEUE_SIZE')!"));      
+        return false;
+    }
+    m_pQueue[m_QueueCount++] = pValue;
+    return true;
+}
+
+void EmPersistentState::_dequeue() {
+    for (uint8_t i=1; i < m_QueueCount; i++) {
+        m_pQueue[i-1] = m_pQueue[i];
+    }
+    m_QueueCount--;
+    m_QueueOffset = 0;
+}
+
+void EmPersistentState::_flushValue(EmPersistentValueBase* pValue) {
+    for (uint8_t i=0; i < m_QueueCount; i++) {
+        if (pValue == m_pQueue[i]) {
+            // NOTE: not bounded, the whole value is written
+            if (pValue->IsStored() && !_writeValue(pValue)) {
+                LogError(F("Destroyed value write failed, changes lost!"));      
+            }
+            break;
+        }
+    }
+    _cancelValue(pValue);
+}
+
+void EmPersistentState::_cancelValue(const EmPersistentValueBase* pValue) {
+    uint8_t count = 0;
+    for (uint8_t i=0; i < m_QueueCount; i++) {
+        if (pValue == m_pQueue[i]) {
+            if (0 == i) {
+                // Being written: the next one starts from its beginning
+                m_QueueOffset = 0;
+            }
+        } else {
+            m_pQueue[count++] = m_pQueue[i];
+        }
+    }
+    m_QueueCount = count;
+}
+#endif // EM_PS_WCET
+
+void EmPersistentState::_moveContainers() {
+    // NOTE: records are only moved backwards, copying them by ascending 
+    //       addresses never overwrites a not yet read byte
+    ps_address_t index = _firstPvAddress();
+    EmPersistentId psId;
+    ps_size_t psSize = 0;
+    while (_readRecord(index, psId, psSize)) {
+        const ps_size_t recordSize = EmPersistentLayout::RecordSize(psSize);
+        if (_isContainer(psId) && psId != c_HashIndexId && psId != c_TreeId) {
+            for (ps_size_t i=0; index != m_NextPvAddress && i < recordSize; i++) {
+                _updateByte((ps_address_t)(m_NextPvAddress + i), 
+                            _readByte((ps_address_t)(index + i)));
+            }
+            m_NextPvAddress = (ps_address_t)(m_NextPvAddress + recordSize);
+        }
+        index = (ps_address_t)(index + recordSize);
+    }
+    c_FooterId._store(*this, m_NextPvAddress);
+}
+
+bool EmPersistentState::_findContainer(const EmPersistentId& recordId,
+                                       const EmPersistentId& id,
+                                       ps_address_t& address, 
+                                       ps_size_t& size) const {
+    address = _firstPvAddress();
+    EmPersistentId psId;
+    while (_readRecord(address, psId, size)) {
+        if (psId == recordId) {
+            EmPersistentId containerId;
+            if (containerId._read(*this, (ps_address_t)(address + EmPersistentLayout::HeaderSize())) && 
+                containerId == id) {
+                return true;
+            }
+        }
+        address = (ps_address_t)(address + EmPersistentLayout::RecordSize(size));
+    }
+    return false;
+}
+
+bool EmPersistentState::_appendContainer(const EmPersistentId& recordId,
+                                         const EmPersistentId& id,
+                                         ps_size_t size,
+                                         ps_address_t& address) {
+#if EM_PS_SEGMENT_SIZE > 0
+    if (!_markSegment(EmPersistentLayout::RecordSize(size))) {
+        return false;
+    }
+#endif
+    address = m_NextPvAddress;
+    const ps_address_t valueAddress = (ps_address_t)(address + EmPersistentLayout::HeaderSize());
+    const ps_address_t footerAddress = (ps_address_t)(address + EmPersistentLayout::RecordSize(size));
+    if (!_indexCheck(footerAddress, EmPersistentId::c_MaxLen) ||
+        !c_FooterId._store(*this, footerAddress) ||
+        !id._store(*this, valueAddress)) {
+        return false;
+    }
+    // Write the zeroed content, then the header replacing the old footer
+    for (ps_size_t i=EmPersistentId::c_MaxLen; i < size; i++) {
+        _updateByte((ps_address_t)(valueAddress + i), 0);
+    }
+    if (!_updateSize((ps_address_t)(address + EmPersistentId::c_MaxLen), size) ||
+        !recordId._store(*this, address)) {
+        return false;
+    }
+    m_NextPvAddress = footerAddress;
+    _indexAppended(NULL);
+    return true;
+}
+
+ps_address_t EmPersistentState::_openContainer(const EmPersistentId& recordId,
+                                               const EmPersistentId& id,
+                                               uint32_t contentSize) {
+    if (!_isInitialized(true)) {
+        return 0;
+    }
+    if (_isFlash()) {
+        LogError(F("Record type not supported by flash media!"));      
+        return 0;
+    }
+    // The container id followed by its content
+    const ps_size_t idSize = EmPersistentLayout::Aligned(EmPersistentId::c_MaxLen);
+    if (!_containerFits(idSize + contentSize)) {
+        return 0;
+    }
+    const ps_size_t size = (ps_size_t)(idSize + contentSize);
+    ps_address_t address = 0;
+    ps_size_t storedSize = 0;
+    if (_findContainer(recordId, id, address, storedSize) && size != storedSize) {
+        // Geometry changed (e.g. new firmware): content is lost
+        LogError(F("Stored size changed, content cleared!"));      
+        if (!_deleteRecord(address, storedSize)) {
+            return 0;
+        }
+        storedSize = 0;
+    }
+    if (size != storedSize && !_appendContainer(recordId, id, size, address)) {
+        LogError(F("Open failed!"));      
+        return 0;
+    }
+    return (ps_address_t)(address + EmPersistentLayout::HeaderSize() + idSize);
+}
+
+bool EmPersistentState::_containerFits(uint32_t size) const {
+    // NOTE: the PS range is below 'ps_size_t' range
+    if (size + EmPersistentLayout::HeaderSize() >= (uint32_t)(m_EndIndex - m_BeginIndex)) {
+        LogError<50>("Container size %lu exceeds the PS size!", (unsigned long)size);
+        return false;
+    }
+    return true;
+}
+
+bool EmPersistentState::_deleteRecord(ps_address_t address, ps_size_t size) {
+    m_DeletedBytes = (ps_size_t)(m_DeletedBytes + EmPersistentLayout::RecordSize(size));
+    return c_DeletedId._store(*this, address);
+}
+
+bool EmPersistentState::_isContainer(const EmPersistentId& id) {
+    return id == c_NamespaceId || id == c_MapId || id == c_SeriesId || 
+           id == c_TreeId || id == c_HashIndexId;
+}
+
+void EmPersistentState::_indexAppended(const EmPersistentValueBase* pValue) {
+    if (NULL == m_pIndex) {
+        return;
+    }
+    if (NULL == pValue) {
+        // Not a value record (i.e. the indexed PS end only)
+        m_pIndex->_storeEnd();
+    } else {
+        m_pIndex->_insert(pValue->m_Id, pValue->m_BufferSize, pValue->m_Address);
+    }
+}
+
+inline ps_address_t EmPersistentState::_firstPvAddress() const {
+    return (ps_address_t)(m_BeginIndex + EmPersistentLayout::Aligned(EmPersistentId::c_MaxLen));
+}
+
+  //--------------------------------------------------
+ // EmPersistentNamespace class implementation   
+//--------------------------------------------------
+EmPersistentNamespace::EmPersistentNamespace(EmPersistentState& parent, 
+                                             const EmPersistentId& id,
+                                             ps_size_t capacity,
+                                             EmLogLevel logLevel)
+  : EmPersistentState(logLevel),
+    m_Parent(parent),
+    m_Id(id),
+    m_Capacity(capacity) {
+    // Empty range until opened (i.e. 'Init' fails)
+    m_pMedia = parent.m_pMedia;
+    m_BeginIndex = 0;
+    m_EndIndex = 0;
+}
+
+bool EmPersistentNamespace::Open() {
+    m_NextPvAddress = 0;
+    if (!m_Parent._isInitialized(true)) {
+        return false;
+    }
+    if (m_Parent._isFlash()) {
+        LogError(F("Namespaces not supported by flash media!"));      
+        return false;
+    }
+    ps_address_t address = 0;
+    ps_size_t size = 0;
+    const bool created = !m_Parent._findContainer(c_NamespaceId, m_Id, address, size);
+    if (created) {
+        if (m_Capacity < c_MinSize) {
+            LogError<40>("Namespace capacity below %d!", c_MinSize);
+            return false;
+        }
+        const uint32_t wideSize = (uint32_t)EmPersistentLayout::Aligned(EmPersistentId::c_MaxLen) + m_Capacity;
+        if (!m_Parent._containerFits(wideSize)) {
+            return false;
+        }
+        size = (ps_size_t)wideSize;
+        if (!m_Parent._appendContainer(c_NamespaceId, m_Id, size, address)) {
+            LogError(F("Open failed!"));      
+            return false;
+        }
+    }
+    // The namespace id followed by its own PS
+    const ps_address_t valueAddress = (ps_address_t)(address + EmPersistentLayout::HeaderSize());
+    m_BeginIndex = (ps_address_t)(valueAddress + EmPersistentLayout::Aligned(EmPersistentId::c_MaxLen));
+    m_EndIndex = (ps_address_t)(valueAddress + size);
+    return !created || _clear();
+}
+
+  //--------------------------------------------------
+ // EmPersistentMapBase class implementation   
+//--------------------------------------------------
+EmPersistentMapBase::EmPersistentMapBase(EmPersistentState& ps, 
+                                         const EmPersistentId& id,
+                                         uint16_t slots,
+                                         ps_size_t keySize,
+                                         ps_size_t valueSize)
+ : m_Ps(ps),
+   m_Id(id),
+   m_Address(0),
+   m_Slots(slots),
+   m_KeySize(keySize),
+   m_ValueSize(valueSize),
+   m_Used(0),
+   m_Deleted(0) {
+}
+
+bool EmPersistentMapBase::_open(const EmPersistentId& recordId) {
+    m_Address = m_Ps._openContainer(recordId, m_Id, 
+                                    (uint32_t)m_Slots*_slotSize());
+    if (0 == m_Address) {
+        return false;
+    }
+    // Count used & deleted slots
+    m_Used = 0;
+    m_Deleted = 0;
+    for (uint16_t slot=0; slot < m_Slots; slot++) {
+        const uint8_t state = _state(slot);
+        if (c_Deleted == state) {
+            m_Deleted++;
+        } else if (c_Empty != state) {
+            m_Used++;
+        }
+    }
+    return true;
+}
+
+bool EmPersistentMapBase::Clear() {
+    if (!_isOpen()) {
+        return false;
+    }
+    for (uint16_t slot=0; slot < m_Slots; slot++) {
+        if (!_setState(slot, c_Empty)) {
+            return false;
+        }
+    }
+    m_Used = 0;
+    m_Deleted = 0;
+    return true;
+}
+
+bool EmPersistentMapBase::_get(const void* pKey, void* pValue) const {
+    uint16_t slot = 0;
+    uint16_t freeSlot = 0;
+    if (!_isOpen() || !_probe(pKey, slot, freeSlot)) {
+        return false;
+    }
+    return m_Ps._readBytes((ps_address_t)(_slotAddress(slot) + 1 + m_KeySize), 
+                           (uint8_t*)pValue, m_ValueSize);
+}
+
+bool EmPersistentMapBase::_put(const void* pKey, const void* pValue) {
+    uint16_t slot = 0;
+    uint16_t freeSlot = 0;
+    if (!_isOpen()) {
+        return false;
+    }
+    const ps_address_t valueOffset = (ps_address_t)(1 + m_KeySize);
+    if (_probe(pKey, slot, freeSlot)) {
+        // Update in place
+        return m_Ps._updateBytes((ps_address_t)(_slotAddress(slot) + valueOffset), 
+                                 (const uint8_t*)pValue, m_ValueSize);
+    }
+    if (m_Slots == freeSlot) {
+        m_Ps.LogError(F("Map full!"));      
+        return false;
+    }
+    // Write the entry, then mark the slot as used
+    const bool wasDeleted = c_Deleted == _state(freeSlot);
+    const ps_address_t address = _slotAddress(freeSlot);
+    if (!m_Ps._updateBytes((ps_address_t)(address + 1), (const uint8_t*)pKey, m_KeySize) ||
+        !m_Ps._updateBytes((ps_address_t)(address + valueOffset), (const uint8_t*)pValue, m_ValueSize) ||
+        !_setState(freeSlot, c_Used)) {
+        return false;
+    }
+    m_Used++;
+    if (wasDeleted) {
+        m_Deleted--;
+    }
+    return true;
+}
+
+bool EmPersistentMapBase::_erase(const void* pKey) {
+    uint16_t slot = 0;
+    uint16_t freeSlot = 0;
+    if (!_isOpen() || !_probe(pKey, slot, freeSlot) || !_setState(slot, c_Deleted)) {
+        return false;
+    }
+    m_Used--;
+    m_Deleted++;
+    return true;
+}
+
+bool EmPersistentMapBase::_rehash(uint8_t* pEntry, uint8_t* pOther) {
+    if (!_isOpen()) {
+        return false;
+    }
+    // Mark used entries to be moved, then drop tombstones (i.e. a reset before
+    // the first pending entry keeps all probe sequences)
+    for (uint16_t slot=0; slot < m_Slots; slot++) {
+        if (c_Used == _state(slot) && !_setState(slot, c_Pending)) {
+            return false;
+        }
+    }
+    for (uint16_t slot=0; slot < m_Slots; slot++) {
+        if (c_Deleted == _state(slot) && !_setState(slot, c_Empty)) {
+            return false;
+        }
+    }
+    // Move each pending entry to its probe sequence first empty or pending 
+    // slot, a pending entry found there is moved next (i.e. no extra slots)
+    // NOTE: 
+    //  entries are only in RAM while they are moved (i.e. not power loss safe),
+    //  a slot is emptied before being written so a reset never leaves a partly 
+    //  written entry (see 'EmPersistentMap::Open')
+    const ps_size_t slotSize = _slotSize();
+    uint16_t used = 0;
+    for (uint16_t slot=0; slot < m_Slots; slot++) {
+        if (c_Pending != _state(slot)) {
+            continue;
+        }
+        if (!m_Ps._readBytes(_slotAddress(slot), pEntry, slotSize) || 
+            !_setState(slot, c_Empty)) {
+            return false;
+        }
+        while (true) {
+            uint16_t target = _hash(pEntry + 1);
+            uint8_t state = _state(target);
+            while (c_Empty != state && c_Pending != state) {
+                target = (uint16_t)((target + 1) % m_Slots);
+                state = _state(target);
+            }
+            if (c_Pending == state && 
+                (!m_Ps._readBytes(_slotAddress(target), pOther, slotSize) ||
+                 !_setState(target, c_Empty))) {
+                return false;
+            }
+            // The entry first, then its state
+            if (!m_Ps._updateBytes((ps_address_t)(_slotAddress(target) + 1), 
+                                   pEntry + 1, (ps_size_t)(slotSize - 1)) ||
+                !_setState(target, c_Used)) {
+                return false;
+            }
+            used++;
+            if (c_Empty == state) {
+                break;
+            }
+            memcpy(pEntry, pOther, slotSize);
+        }
+    }
+    // NOTE: entries lost by a stopped rehash are not counted
+    m_Used = used;
+    m_Deleted = 0;
+    return true;
+}
+
+bool EmPersistentMapBase::_hasPending() const {
+    for (uint16_t slot=0; slot < m_Slots; slot++) {
+        if (c_Pending == _state(slot)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EmPersistentMapBase::_probe(const void* pKey, uint16_t& slot, uint16_t& freeSlot) const {
+    freeSlot = m_Slots;
+    slot = _hash(pKey);
+    for (uint16_t n=0; n < m_Slots; n++) {
+        const uint8_t state = _state(slot);
+        if (c_Empty == state || c_Deleted == state) {
+            if (m_Slots == freeSlot) {
+                freeSlot = slot;
+            }
+            if (c_Empty == state) {
+                // End of the probe sequence
+                return false;
+            }
+        } else if (_keyMatch(slot, pKey)) {
+            return true;
+        }
+        slot = (uint16_t)((slot + 1) % m_Slots);
+    }
+    return false;
+}
+
+bool EmPersistentMapBase::_keyMatch(uint16_t slot, const void* pKey) const {
+    const ps_address_t address = (ps_address_t)(_slotAddress(slot) + 1);
+    for (ps_size_t i=0; i < m_KeySize; i++) {
+        if (((const uint8_t*)pKey)[i] != m_Ps._readByte((ps_address_t)(address + i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint16_t EmPersistentMapBase::_hash(const void* pKey) const {
+    // FNV-1a of the key bytes
+    uint32_t hash = 2166136261UL;
+    for (ps_size_t i=0; i < m_KeySize; i++) {
+        hash = (uint32_t)((hash ^ ((const uint8_t*)pKey)[i]) * 16777619UL);
+    }
+    return (uint16_t)(hash % m_Slots);
+}
+
+uint8_t EmPersistentMapBase::_state(uint16_t slot) const {
+    return m_Ps._readByte(_slotAddress(slot));
+}
+
+bool EmPersistentMapBase::_setState(uint16_t slot, uint8_t state) {
+    return m_Ps._updateByte(_slotAddress(slot), state);
+}
+
+  //--------------------------------------------------
+ // EmPersistentHashIndex class implementation   
+//--------------------------------------------------
+EmPersistentHashIndex::EmPersistentHashIndex(EmPersistentState& ps, 
+                                             const EmPersistentId& id,
+                                             uint16_t slots)
+ : EmPersistentMapBase(ps, id, slots, c_KeySize, c_EntrySize),
+   m_State(ps),
+   m_Complete(false) {
+}
+
+EmPersistentHashIndex::~EmPersistentHashIndex() {
+    if (m_State.m_pIndex == this) {
+        m_State.m_pIndex = NULL;
+    }
+}
+
+bool EmPersistentHashIndex::Open() {
+    if (m_State.m_pIndex == this) {
+        m_State.m_pIndex = NULL;
+    }
+    if (!_open(EmPersistentState::c_HashIndexId)) {
+        return false;
+    }
+    // Rebuild if values were stored while the index was not attached
+    _Entry end;
+    m_Complete = _getEntry(c_EndKey, end) && end.address == m_State.m_NextPvAddress;
+    if (!m_Complete && !Rebuild()) {
+        return false;
+    }
+    m_State.m_pIndex = this;
+    return true;
+}
+
+bool EmPersistentHashIndex::Rebuild() {
+    m_Complete = false;
+    if (!Clear()) {
+        return false;
+    }
+    ps_address_t index = m_State._firstPvAddress();
+    EmPersistentId psId;
+    ps_size_t psSize = 0;
+    while (m_State._readNext(index, psId, psSize)) {
+        uint8_t key[c_KeySize];
+        _encodeKey(psId._key(), key);
+        _Entry entry;
+        uint16_t slot = 0;
+        uint16_t freeSlot = 0;
+        // NOTE: the first stored value wins (i.e. same as the chain scan)
+        if (!_probe(key, slot, freeSlot)) {
+            entry.size = psSize;
+            entry.address = (ps_address_t)(index - EmPersistentLayout::HeaderSize());
+            if (!_putEntry(psId._key(), entry)) {
+                // Full index: lookups misses are scanning the chain
+                return false;
+            }
+        }
+        // Move index to next PS item
+        index = (ps_address_t)(index + EmPersistentLayout::Aligned(psSize));
+    }
+    m_Complete = true;
+    return _storeEnd();
+}
+
+bool EmPersistentHashIndex::_lookup(const EmPersistentId& id, 
+                                    ps_size_t size, 
+                                    ps_address_t& address, 
+                                    bool& complete) const {
+    _Entry entry;
+    if (!_getEntry(id._key(), entry)) {
+        complete = m_Complete;
+        return false;
+    }
+    // Same id with another size (e.g. a grown value) is scanned
+    complete = false;
+    address = entry.address;
+    return size == entry.size;
+}
+
+bool EmPersistentHashIndex::_insert(const EmPersistentId& id, ps_size_t size, ps_address_t address) {
+    _Entry entry;
+    entry.size = size;
+    entry.address = address;
+    if (!_putEntry(id._key(), entry)) {
+        m_Complete = false;
+        return false;
+    }
+    return _storeEnd();
+}
+
+bool EmPersistentHashIndex::_storeEnd() {
+    _Entry end;
+    end.size = 0;
+    end.address = m_Complete ? m_State.m_NextPvAddress : 0;
+    if (!_putEntry(c_EndKey, end)) {
+        m_Complete = false;
+        return false;
+    }
+    return true;
+}
+
+bool EmPersistentHashIndex::_getEntry(uint32_t key, _Entry& entry) const {
+    uint8_t keyBytes[c_KeySize];
+    uint8_t bytes[c_EntrySize];
+    _encodeKey(key, keyBytes);
+    if (!_get(keyBytes, bytes)) {
+        return false;
+    }
+    entry.size = (ps_size_t)(bytes[0] | (bytes[1] << 8));
+    entry.address = (ps_address_t)(bytes[2] | (bytes[3] << 8));
+    return true;
+}
+
+bool EmPersistentHashIndex::_putEntry(uint32_t key, const _Entry& entry) {
+    uint8_t keyBytes[c_KeySize];
+    uint8_t bytes[c_EntrySize];
+    _encodeKey(key, keyBytes);
+    bytes[0] = (uint8_t)entry.size;
+    bytes[1] = (uint8_t)(entry.size >> 8);
+    bytes[2] = (uint8_t)entry.address;
+    bytes[3] = (uint8_t)(entry.address >> 8);
+    return _put(keyBytes, bytes);
+}
+
+void EmPersistentHashIndex::_encodeKey(uint32_t key, uint8_t* pKey) {
+    pKey[0] = (uint8_t)key;
+    pKey[1] = (uint8_t)(key >> 8);
+    pKey[2] = (uint8_t)(key >> 16);
+    pKey[3] = (uint8_t)(key >> 24);
+}
+
+  //--------------------------------------------------
+ // EmPersistentTreeIndexBase class implementation   
+//--------------------------------------------------
+EmPersistentTreeIndexBase::EmPersistentTreeIndexBase(EmPersistentState& ps, 
+                                                     const EmPersistentId& id,
+                                                     uint16_t pages,
+                                                     uint8_t* pUsed)
+ : m_State(ps),
+   m_Id(id),
+   m_Address(0),
+   m_Pages(pages),
+   m_pUsed(pUsed),
+   m_Selector(0),
+   m_Root(c_NoPage),
+   m_Count(0),
+   m_Complete(false) {
+}
+
+EmPersistentTreeIndexBase::~EmPersistentTreeIndexBase() {
+    if (m_State.m_pIndex == this) {
+        m_State.m_pIndex = NULL;
+    }
+}
+
+bool EmPersistentTreeIndexBase::Open() {
+    if (m_State.m_pIndex == this) {
+        m_State.m_pIndex = NULL;
+    }
+    m_Complete = false;
+    m_Address = m_State._openContainer(EmPersistentState::c_TreeId, m_Id, 
+                                       c_PagesOffset + (uint32_t)m_Pages * EM_PS_TREE_PAGE_SIZE);
+    if (0 == m_Address) {
+        return false;
+    }
+    // Read the selected root slot (i.e. the root page is stored plus one)
+    m_Selector = (uint8_t)(m_State._readByte(m_Address) & 1);
+    const ps_address_t slot = (ps_address_t)(m_Address + 1 + m_Selector * c_RootSlotSize);
+    ps_size_t root = 0;
+    ps_size_t end = 0;
+    if (!m_State._readSize(slot, root) || 
+        !m_State._readSize((ps_address_t)(slot + 2), end) ||
+        !m_State._readSize((ps_address_t)(slot + 4), m_Count)) {
+        return false;
+    }
+    m_Root = (uint16_t)(root - 1);
+    memset(m_pUsed, 0, (size_t)((m_Pages + 7) / 8));
+    // Rebuild if values were stored while the index was not attached
+    m_Complete = 0 != end && end == m_State.m_NextPvAddress && 
+                 (c_NoPage == m_Root || _walk(m_Root, 0));
+    if (!m_Complete && !Rebuild()) {
+        return false;
+    }
+    m_State.m_pIndex = this;
+    return true;
+}
+
+bool EmPersistentTreeIndexBase::Rebuild() {
+    m_Complete = false;
+    if (0 == m_Address) {
+        return false;
+    }
+    memset(m_pUsed, 0, (size_t)((m_Pages + 7) / 8));
+    if (!_storeRoot(c_NoPage, 0)) {
+        return false;
+    }
+    ps_address_t index = m_State._firstPvAddress();
+    EmPersistentId psId;
+    ps_size_t psSize = 0;
+    while (m_State._readNext(index, psId, psSize)) {
+        // NOTE: the first stored value wins (i.e. same as the chain scan)
+        if (!_add(psId.OrderKey(), psSize, 
+                  (ps_address_t)(index - EmPersistentLayout::HeaderSize()), false)) {
+            // Full index: lookups misses are scanning the chain
+            return false;
+        }
+        // Move index to next PS item
+        index = (ps_address_t)(index + EmPersistentLayout::Aligned(psSize));
+    }
+    m_Complete = true;
+    return _storeEnd();
+}
+
+uint16_t EmPersistentTreeIndexBase::UsedPages() const {
+    uint16_t used = 0;
+    for (uint16_t i=0; i < m_Pages; i++) {
+        if (_isUsed(i)) {
+            used++;
+        }
+    }
+    return used;
+}
+
+uint8_t EmPersistentTreeIndexBase::Height() const {
+    uint8_t height = 0;
+    uint16_t pageIndex = m_Root;
+    // Follow the first children down to a leaf (i.e. all leaves have same depth)
+    while (c_NoPage != pageIndex && pageIndex < m_Pages && height < c_MaxHeight) {
+        const ps_address_t address = _pageAddress(pageIndex);
+        height++;
+        if (0 != (m_State._readByte(address) & 0x80)) {
+            break;
+        }
+        if (!m_State._readSize((ps_address_t)(address + 1 + 6), pageIndex)) {
+            break;
+        }
+    }
+    return height;
+}
+
+bool EmPersistentTreeIndexBase::_lookup(const EmPersistentId& id, 
+                                        ps_size_t size, 
+                                        ps_address_t& address, 
+                                        bool& complete) const {
+    const uint32_t key = id.OrderKey();
+    uint32_t foundKey = 0;
+    ps_size_t foundSize = 0;
+    ps_address_t foundAddress = 0;
+    bool inclusive = true;
+    bool sameKey = false;
+    // Visit the 'id' entries (i.e. one per stored size)
+    while (_seek(key, foundSize, inclusive, foundKey, foundSize, foundAddress) && key == foundKey) {
+        if (size == foundSize) {
+            complete = false;
+            address = foundAddress;
+            return true;
+        }
+        // Same id with another size (e.g. a grown value) is scanned
+        sameKey = true;
+        inclusive = false;
+    }
+    complete = m_Complete && !sameKey;
+    return false;
+}
+
+bool EmPersistentTreeIndexBase::_insert(const EmPersistentId& id, ps_size_t size, ps_address_t address) {
+    if (!_add(id.OrderKey(), size, address, true)) {
+        m_Complete = false;
+        _storeEnd();
+        return false;
+    }
+    return true;
+}
+
+bool EmPersistentTreeIndexBase::_storeEnd() {
+    return _storeRoot(m_Root, m_Count);
+}
+
+bool EmPersistentTreeIndexBase::_seek(uint32_t key, 
+                                      ps_size_t size, 
+                                      bool inclusive,
+                                      uint32_t& foundKey,
+                                      ps_size_t& foundSize,
+                                      ps_address_t& address) const {
+    _Page page;
+    uint16_t path[c_MaxHeight];
+    uint8_t slots[c_MaxHeight];
+    uint8_t depth = 0;
+    if (!_descend(key, size, page, path, slots, depth)) {
+        return false;
+    }
+    while (true) {
+        // First leaf entry after the requested one
+        const uint8_t count = _count(page);
+        for (uint8_t i=0; i < count; i++) {
+            uint32_t entryKey = 0;
+            ps_size_t entrySize = 0;
+            uint16_t value = 0;
+            _getEntry(page, i, entryKey, entrySize, value);
+            const int compare = _compare(entryKey, entrySize, key, size);
+            if (compare > 0 || (inclusive && 0 == compare)) {
+                foundKey = entryKey;
+                foundSize = entrySize;
+                address = value;
+                return true;
+            }
+        }
+        // Go up to the first parent having a next child
+        uint16_t child = c_NoPage;
+        while (c_NoPage == child && depth > 0) {
+            depth--;
+            if (!_readPage(path[depth], page)) {
+                return false;
+            }
+            if (slots[depth] + 1 < _count(page)) {
+                uint32_t entryKey = 0;
+                ps_size_t entrySize = 0;
+                slots[depth]++;
+                _getEntry(page, slots[depth], entryKey, entrySize, child);
+                depth++;
+            }
+        }
+        if (c_NoPage == child) {
+            // Last leaf
+            return false;
+        }
+        // Go down to its first leaf
+        while (true) {
+            if (!_readPage(child, page)) {
+                return false;
+            }
+            path[depth] = child;
+            if (_isLeaf(page)) {
+                break;
+            }
+            if (0 == _count(page) || depth + 1 >= c_MaxHeight) {
+                return false;
+            }
+            uint32_t entryKey = 0;
+            ps_size_t entrySize = 0;
+            slots[depth] = 0;
+            _getEntry(page, 0, entryKey, entrySize, child);
+            depth++;
+        }
+    }
+}
+
+bool EmPersistentTreeIndexBase::_add(uint32_t key, ps_size_t size, ps_address_t address, bool replace) {
+    _Page page;
+    _Page right;
+    uint16_t path[c_MaxHeight];
+    uint8_t slots[c_MaxHeight];
+    uint8_t depth = 0;
+    uint16_t count = m_Count;
+    const uint16_t oldRoot = m_Root;
+    if (c_NoPage == oldRoot) {
+        _setHeader(page, true, 0);
+    } else if (!_descend(key, size, page, path, slots, depth)) {
+        return false;
+    }
+    // Leaf entry position
+    const uint8_t entries = _count(page);
+    uint8_t pos = 0;
+    int compare = 1;
+    for (; pos < entries; pos++) {
+        uint32_t entryKey = 0;
+        ps_size_t entrySize = 0;
+        uint16_t value = 0;
+        _getEntry(page, pos, entryKey, entrySize, value);
+        compare = _compare(entryKey, entrySize, key, size);
+        if (compare >= 0) {
+            if (0 == compare && (!replace || value == address)) {
+                // Nothing to copy
+                return _storeEnd();
+            }
+            break;
+        }
+    }
+    if (pos < entries && 0 == compare) {
+        _setEntry(page, pos, key, size, address);
+    } else {
+        if (0xFFFF == count) {
+            return false;
+        }
+        _insertEntry(page, pos, key, size, address);
+        count++;
+    }
+    // Copy the leaf to root path (i.e. splitting full pages)
+    uint16_t left = c_NoPage;
+    uint16_t rightIndex = c_NoPage;
+    uint32_t rightKey = 0;
+    ps_size_t rightSize = 0;
+    bool split = false;
+    uint16_t fresh[2 * c_MaxHeight];
+    uint8_t freshCount = 0;
+    uint8_t level = depth;
+    bool stored = true;
+    while (true) {
+        if (!_storeSplit(page, right, left, rightIndex, split)) {
+            stored = false;
+            break;
+        }
+        fresh[freshCount++] = left;
+        if (split) {
+            uint16_t value = 0;
+            fresh[freshCount++] = rightIndex;
+            _getEntry(right, 0, rightKey, rightSize, value);
+        }
+        if (0 == level) {
+            break;
+        }
+        level--;
+        if (!_readPage(path[level], page)) {
+            stored = false;
+            break;
+        }
+        uint32_t entryKey = 0;
+        ps_size_t entrySize = 0;
+        uint16_t value = 0;
+        _getEntry(page, slots[level], entryKey, entrySize, value);
+        _setEntry(page, slots[level], entryKey, entrySize, left);
+        if (split) {
+            _insertEntry(page, (uint8_t)(slots[level] + 1), rightKey, rightSize, rightIndex);
+        }
+    }
+    uint16_t root = left;
+    if (stored && split) {
+        // New root (i.e. its first entry key is never compared)
+        _setHeader(page, false, 2);
+        _setEntry(page, 0, 0, 0, left);
+        _setEntry(page, 1, rightKey, rightSize, rightIndex);
+        stored = depth + 2 <= c_MaxHeight && _storePage(page, root);
+    }
+    if (!stored || !_storeRoot(root, count)) {
+        // The previous tree is kept
+        for (uint8_t i=0; i < freshCount; i++) {
+            _setUsed(fresh[i], false);
+        }
+        return false;
+    }
+    // Release the previous path pages
+    if (c_NoPage != oldRoot) {
+        for (uint8_t i=0; i <= depth; i++) {
+            _setUsed(path[i], false);
+        }
+    }
+    return true;
+}
+
+bool EmPersistentTreeIndexBase::_descend(uint32_t key, 
+                                         ps_size_t size, 
+                                         _Page& page, 
+                                         uint16_t* pPath, 
+                                         uint8_t* pSlots, 
+                                         uint8_t& depth) const {
+    uint16_t pageIndex = m_Root;
+    depth = 0;
+    if (c_NoPage == pageIndex) {
+        return false;
+    }
+    while (true) {
+        if (!_readPage(pageIndex, page)) {
+            return false;
+        }
+        pPath[depth] = pageIndex;
+        if (_isLeaf(page)) {
+            return true;
+        }
+        const uint8_t count = _count(page);
+        if (0 == count || depth + 1 >= c_MaxHeight) {
+            return false;
+        }
+        // Last child whose separator is not after the entry
+        uint8_t slot = 0;
+        for (uint8_t i=1; i < count; i++) {
+            uint32_t entryKey = 0;
+            ps_size_t entrySize = 0;
+            uint16_t value = 0;
+            _getEntry(page, i, entryKey, entrySize, value);
+            if (_compare(entryKey, entrySize, key, size) > 0) {
+                break;
+            }
+            slot = i;
+        }
+        uint32_t entryKey = 0;
+        ps_size_t entrySize = 0;
+        _getEntry(page, slot, entryKey, entrySize, pageIndex);
+        pSlots[depth++] = slot;
+    }
+}
+
+bool EmPersistentTreeIndexBase::_walk(uint16_t page, uint8_t depth) {
+    // NOTE: used pages found twice are a corrupted tree (i.e. cycles)
+    if (page >= m_Pages || depth >= c_MaxHeight || _isUsed(page)) {
+        return false;
+    }
+    _setUsed(page, true);
+    const ps_address_t address = _pageAddress(page);
+    const uint8_t header = m_State._readByte(address);
+    const uint8_t count = (uint8_t)(header & 0x7F);
+    if (count > c_PageEntries) {
+        return false;
+    }
+    if (0 != (header & 0x80)) {
+        return true;
+    }
+    for (uint8_t i=0; i < count; i++) {
+        uint16_t child = 0;
+        if (!m_State._readSize((ps_address_t)(address + 1 + i * 8 + 6), child) || 
+            !_walk(child, (uint8_t)(depth + 1))) {
+            return false;
+        }
+    }
+    return 0 < count;
+}
+
+bool EmPersistentTreeIndexBase::_storePage(const _Page& page, uint16_t& pageIndex) {
+    for (uint16_t i=0; i < m_Pages; i++) {
+        if (!_isUsed(i)) {
+            if (!m_State._updateBytes(_pageAddress(i), page.bytes, EM_PS_TREE_PAGE_SIZE)) {
+                return false;
+            }
+            _setUsed(i, true);
+            pageIndex = i;
+            return true;
+        }
+    }
+    m_State.LogError(F("Tree index full"));
+    return false;
+}
+
+bool EmPersistentTreeIndexBase::_storeSplit(_Page& page, 
+                                            _Page& right, 
+                                            uint16_t& leftIndex, 
+                                            uint16_t& rightIndex, 
+                                            bool& split) {
+    const uint8_t count = _count(page);
+    split = count > c_PageEntries;
+    if (split) {
+        // Upper half moved to the right page
+        const uint8_t half = (uint8_t)(count / 2);
+        _setHeader(right, _isLeaf(page), (uint8_t)(count - half));
+        memcpy(right.bytes + 1, page.bytes + 1 + half * 8, (size_t)((count - half) * 8));
+        _setHeader(page, _isLeaf(page), half);
+        if (!_storePage(right, rightIndex)) {
+            return false;
+        }
+    }
+    if (!_storePage(page, leftIndex)) {
+        if (split) {
+            _setUsed(rightIndex, false);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool EmPersistentTreeIndexBase::_storeRoot(uint16_t root, uint16_t count) {
+    // Inactive slot first, then the selector (i.e. one byte write commit)
+    const uint8_t selector = (uint8_t)(1 - m_Selector);
+    const ps_address_t slot = (ps_address_t)(m_Address + 1 + selector * c_RootSlotSize);
+    if (!m_State._updateSize(slot, (ps_size_t)(root + 1)) || 
+        !m_State._updateSize((ps_address_t)(slot + 2), m_Complete ? m_State.m_NextPvAddress : 0) ||
+        !m_State._updateSize((ps_address_t)(slot + 4), count) ||
+        !m_State._updateByte(m_Address, selector)) {
+        return false;
+    }
+    m_Selector = selector;
+    m_Root = root;
+    m_Count = count;
+    return true;
+}
+
+bool EmPersistentTreeIndexBase::_readPage(uint16_t pageIndex, _Page& page) const {
+    if (pageIndex >= m_Pages || 
+        !m_State._readBytes(_pageAddress(pageIndex), page.bytes, EM_PS_TREE_PAGE_SIZE)) {
+        return false;
+    }
+    return _count(page) <= c_PageEntries;
+}
+
+ps_address_t EmPersistentTreeIndexBase::_pageAddress(uint16_t pageIndex) const {
+    return (ps_address_t)(m_Address + c_PagesOffset + pageIndex * EM_PS_TREE_PAGE_SIZE);
+}
+
+bool EmPersistentTreeIndexBase::_isUsed(uint16_t pageIndex) const {
+    return 0 != (m_pUsed[pageIndex / 8] & (1 << (pageIndex % 8)));
+}
+
+void EmPersistentTreeIndexBase::_setUsed(uint16_t pageIndex, bool used) {
+    if (used) {
+        m_pUsed[pageIndex / 8] = (uint8_t)(m_pUsed[pageIndex / 8] | (1 << (pageIndex % 8)));
+    } else {
+        m_pUsed[pageIndex / 8] = (uint8_t)(m_pUsed[pageIndex / 8] & ~(1 << (pageIndex % 8)));
+    }
+}
+
+bool EmPersistentTreeIndexBase::_isLeaf(const _Page& page) {
+    return 0 != (page.bytes[0] & 0x80);
+}
+
+uint8_t EmPersistentTreeIndexBase::_count(const _Page& page) {
+    return (uint8_t)(page.bytes[0] & 0x7F);
+}
+
+void EmPersistentTreeIndexBase::_setHeader(_Page& page, bool leaf, uint8_t count) {
+    page.bytes[0] = (uint8_t)((leaf ? 0x80 : 0) | count);
+}
+
+void EmPersistentTreeIndexBase::_getEntry(const _Page& page, 
+                                          uint8_t entry, 
+                                          uint32_t& key, 
+                                          ps_size_t& size, 
+                                          uint16_t& value) {
+    // Little endian fields (i.e. same image on every target)
+    const uint8_t* pEntry = page.bytes + 1 + entry * 8;
+    key = (uint32_t)pEntry[0] | ((uint32_t)pEntry[1] << 8) | 
+          ((uint32_t)pEntry[2] << 16) | ((uint32_t)pEntry[3] << 24);
+    size = (ps_size_t)(pEntry[4] | (pEntry[5] << 8));
+    value = (uint16_t)(pEntry[6] | (pEntry[7] << 8));
+}
+
+void EmPersistentTreeIndexBase::_setEntry(_Page& page, 
+                                          uint8_t entry, 
+                                          uint32_t key, 
+                                          ps_size_t size, 
+                                          uint16_t value) {
+    uint8_t* pEntry = page.bytes + 1 + entry * 8;
+    pEntry[0] = (uint8_t)key;
+    pEntry[1] = (uint8_t)(key >> 8);
+    pEntry[2] = (uint8_t)(key >> 16);
+    pEntry[3] = (uint8_t)(key >> 24);
+    pEntry[4] = (uint8_t)size;
+    pEntry[5] = (uint8_t)(size >> 8);
+    pEntry[6] = (uint8_t)value;
+    pEntry[7] = (uint8_t)(value >> 8);
+}
+
+void EmPersistentTreeIndexBase::_insertEntry(_Page& page, 
+                                             uint8_t entry, 
+                                             uint32_t key, 
+                                             ps_size_t size, 
+                                             uint16_t value) {
+    const uint8_t count = _count(page);
+    memmove(page.bytes + 1 + (entry + 1) * 8, 
+            page.bytes + 1 + entry * 8, 
+            (size_t)((count - entry) * 8));
+    _setEntry(page, entry, key, size, value);
+    _setHeader(page, _isLeaf(page), (uint8_t)(count + 1));
+}
+
+int EmPersistentTreeIndexBase::_compare(uint32_t key1, ps_size_t size1, uint32_t key2, ps_size_t size2) {
+    if (key1 != key2) {
+        return key1 < key2 ? -1 : 1;
+    }
+    if (size1 != size2) {
+        return size1 < size2 ? -1 : 1;
+    }
+    return 0;
+}
+
+  //--------------------------------------------------
+ // EmPersistentSeriesBase class implementation   
+//--------------------------------------------------
+EmPersistentSeriesBase::EmPersistentSeriesBase(EmPersistentState& ps, 
+                                               const EmPersistentId& id,
+                                               ps_size_t capacity,
+                                               uint16_t keyInterval)
+ : m_Ps(ps),
+   m_Id(id),
+   m_Address(0),
+   m_Capacity(capacity),
+   m_KeyInterval(keyInterval),
+   m_Count(0),
+   m_Used(0),
+   m_LastRaw(0) {
+}
+
+bool EmPersistentSeriesBase::Open() {
+    m_Address = m_Ps._openContainer(EmPersistentState::c_SeriesId, m_Id, 
+                                    _dataOffset() + m_Capacity);
+    if (0 == m_Address) {
+        return false;
+    }
+    if (!m_Ps._readSize(m_Address, m_Count) ||
+        !m_Ps._readSize((ps_address_t)(m_Address + sizeof(m_Count)), m_Used)) {
+        m_Address = 0;
+        return false;
+    }
+    // Decode the last sample (i.e. next delta base)
+    _Cursor cursor;
+    m_LastRaw = 0;
+    if (m_Count > 0 && 
+        (!_seek((uint16_t)(m_Count - 1), cursor) || !_decodeNext(cursor, m_LastRaw))) {
+        m_Ps.LogError(F("Series corrupted!"));      
+        m_Address = 0;
+        return false;
+    }
+    return true;
+}
+
+bool EmPersistentSeriesBase::Clear() {
+    if (!_isOpen()) {
+        return false;
+    }
+    m_Count = 0;
+    m_Used = 0;
+    m_LastRaw = 0;
+    return _storeHeader();
+}
+
+bool EmPersistentSeriesBase::_append(uint32_t raw) {
+    if (!_isOpen()) {
+        return false;
+    }
+    // Keyframes store the sample, the others the delta from previous one
+    // NOTE: dropping old samples keeps the keyframes positions
+    const bool keyframe = 0 == m_Count % m_KeyInterval;
+    uint8_t bytes[c_MaxVarintSize];
+    const uint8_t len = _varint(_zigzag(keyframe ? raw : raw - m_LastRaw), bytes);
+    if (m_Used + len > m_Capacity) {
+        // NOTE: the last block is kept, it may still leave no room
+        if (!_drop()) {
+            return false;
+        }
+        if (m_Used + len > m_Capacity) {
+            m_Ps.LogError(F("Series capacity too small!"));      
+            return false;
+        }
+    }
+    // Write the new bytes, then commit them by the header
+    if (!m_Ps._updateBytes((ps_address_t)(_dataAddress() + m_Used), bytes, len) ||
+        (keyframe && !_storeKeyframe((uint16_t)(m_Count / m_KeyInterval), m_Used))) {
+        return false;
+    }
+    m_Used = (ps_size_t)(m_Used + len);
+    m_Count++;
+    m_LastRaw = raw;
+    return _storeHeader();
+}
+
+bool EmPersistentSeriesBase::_drop() {
+    // Drop the oldest keyframes blocks freeing about half of the data space 
+    // (i.e. about one byte moved for each appended byte)
+    const uint16_t blocks = (uint16_t)((m_Count + m_KeyInterval - 1) / m_KeyInterval);
+    if (blocks < 2) {
+        m_Ps.LogError(F("Series capacity too small!"));      
+        return false;
+    }
+    uint16_t dropped = 1;
+    ps_size_t offset = _keyframe(dropped);
+    while (dropped < blocks - 1 && offset < m_Used / 2) {
+        dropped++;
+        offset = _keyframe(dropped);
+    }
+    // NOTE: not power loss safe (i.e. the series may be corrupted)
+    const ps_address_t dataAddress = _dataAddress();
+    for (ps_size_t i=offset; i < m_Used; i++) {
+        m_Ps._updateByte((ps_address_t)(dataAddress + i - offset), 
+                         m_Ps._readByte((ps_address_t)(dataAddress + i)));
+    }
+    for (uint16_t block=dropped; block < blocks; block++) {
+        _storeKeyframe((uint16_t)(block - dropped), (ps_size_t)(_keyframe(block) - offset));
+    }
+    m_Count = (uint16_t)(m_Count - dropped*m_KeyInterval);
+    m_Used = (ps_size_t)(m_Used - offset);
+    return _storeHeader();
+}
+
+bool EmPersistentSeriesBase::_seek(uint16_t index, _Cursor& cursor) const {
+    if (!_isOpen() || index >= m_Count) {
+        return false;
+    }
+    // Decode from the nearest keyframe
+    const uint16_t block = (uint16_t)(index / m_KeyInterval);
+    cursor.index = (uint16_t)(block * m_KeyInterval);
+    cursor.offset = _keyframe(block);
+    cursor.raw = 0;
+    uint32_t raw = 0;
+    while (cursor.index < index) {
+        if (!_decodeNext(cursor, raw)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool EmPersistentSeriesBase::_decodeNext(_Cursor& cursor, uint32_t& raw) const {
+    if (cursor.index >= m_Count) {
+        return false;
+    }
+    uint32_t value = 0;
+    uint8_t shift = 0;
+    uint8_t byte = 0;
+    do {
+        if (cursor.offset >= m_Used || shift >= 7*c_MaxVarintSize) {
+            return false;
+        }
+        byte = m_Ps._readByte((ps_address_t)(_dataAddress() + cursor.offset));
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        shift = (uint8_t)(shift + 7);
+        cursor.offset++;
+    } while (0 != (byte & 0x80));
+    const uint32_t delta = _unzigzag(value);
+    raw = 0 == cursor.index % m_KeyInterval ? delta : cursor.raw + delta;
+    cursor.raw = raw;
+    cursor.index++;
+    return true;
+}
+
+ps_size_t EmPersistentSeriesBase::_keyframe(uint16_t block) const {
+    ps_size_t offset = 0;
+    m_Ps._readSize((ps_address_t)(m_Address + 2*sizeof(ps_size_t) + block*sizeof(offset)), offset);
+    return offset;
+}
+
+bool EmPersistentSeriesBase::_storeKeyframe(uint16_t block, ps_size_t offset) {
+    return m_Ps._updateSize((ps_address_t)(m_Address + 2*sizeof(ps_size_t) + block*sizeof(offset)), offset);
+}
+
+bool EmPersistentSeriesBase::_storeHeader() {
+    return m_Ps._updateSize(m_Address, m_Count) &&
+           m_Ps._updateSize((ps_address_t)(m_Address + sizeof(m_Count)), m_Used);
+}
+
+uint8_t EmPersistentSeriesBase::_varint(uint32_t value, uint8_t* bytes) {
+    uint8_t len = 0;
+    while (value >= 0x80) {
+        bytes[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[len++] = (uint8_t)value;
+    return len;
+}
+
+  //--------------------------------------------------
+ // EmPersistentHeaderMirrorBase class implementation   
+//--------------------------------------------------
+EmPersistentHeaderMirrorBase::EmPersistentHeaderMirrorBase(EmPersistentState& ps,
+                                                           uint32_t* pKeys,
+                                                           ps_size_t* pSizes,
+                                                           ps_address_t* pAddresses,
+                                                           uint16_t capacity)
+ : m_Ps(ps),
+   m_pKeys(pKeys),
+   m_pSizes(pSizes),
+   m_pAddresses(pAddresses),
+   m_Capacity(capacity),
+   m_Count(0) {
+}
+
+bool EmPersistentHeaderMirrorBase::Build() {
+    m_Count = 0;
+    if (!m_Ps._isInitialized(true)) {
+        return false;
+    }
+    ps_address_t index = m_Ps._firstPvAddress();
+    EmPersistentId psId;
+    ps_size_t psSize = 0;
+    while (m_Ps._readNext(index, psId, psSize)) {
+        if (m_Count >= m_Capacity) {
+            // A partial mirror would miss values
+            m_Count = 0;
+            return false;
+        }
+        m_pKeys[m_Count] = psId._key();
+        m_pSizes[m_Count] = psSize;
+        m_pAddresses[m_Count] = (ps_address_t)(index - EmPersistentLayout::HeaderSize());
+        m_Count++;
+        // Move index to next PS item
+        index = (ps_address_t)(index + EmPersistentLayout::Aligned(psSize));
+    }
+    return true;
+}
+
+ps_address_t EmPersistentHeaderMirrorBase::Find(const EmPersistentId& id, ps_size_t size) const {
+    const uint32_t key = id._key();
+    for (uint16_t i = Search(m_pKeys, m_Count, 0, key); 
+         i < m_Count; 
+         i = Search(m_pKeys, m_Count, (uint16_t)(i+1), key)) {
+        if (size == m_pSizes[i]) {
+            return m_pAddresses[i];
+        }
+    }
+    return 0;
+}
+
+bool EmPersistentHeaderMirrorBase::Load(EmPersistentValueBase& value) const {
+    const ps_address_t address = Find(value.Id(), value.Size());
+    if (0 == address) {
+        return false;
+    }
+    // Check the record still matches (i.e. mirror not rebuilt)
+    EmPersistentId psId;
+    ps_size_t psSize = 0;
+    if (!m_Ps._readRecord(address, psId, psSize) ||
+        !EmPersistentValueBase::_match(value.Id(), psId, value.Size(), psSize)) {
+        return false;
+    }
+    value.m_Address = address;
+    return m_Ps._readBytes((ps_address_t)(address + EmPersistentLayout::HeaderSize()), 
+                           (uint8_t*)value.m_pValue, 
+                           value.Size());
+}
+
+uint16_t EmPersistentHeaderMirrorBase::Search(const uint32_t* keys, 
+                                              uint16_t count, 
+                                              uint16_t first, 
+                                              uint32_t key) {
+    uint16_t i = first;
+#if defined(__AVX2__)
+    // 8 keys per compare
+    const __m256i needle = _mm256_set1_epi32((int32_t)key);
+    for (; i + 8 <= count; i = (uint16_t)(i + 8)) {
+        const __m256i block = _mm256_loadu_si256((const __m256i*)(keys + i));
+        const uint32_t mask = (uint32_t)_mm256_movemask_ps(
+                                    _mm256_castsi256_ps(_mm256_cmpeq_epi32(block, needle)));
+        if (0 != mask) {
+            return (uint16_t)(i + __builtin_ctz(mask));
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    // 4 keys per compare
+    const __m128i needle4 = _mm_set1_epi32((int32_t)key);
+    for (; i + 4 <= count; i = (uint16_t)(i + 4)) {
+        const __m128i block = _mm_loadu_si128((const __m128i*)(keys + i));
+        const uint32_t mask = (uint32_t)_mm_movemask_ps(
+                                    _mm_castsi128_ps(_mm_cmpeq_epi32(block, needle4)));
+        if (0 != mask) {
+            return (uint16_t)(i + __builtin_ctz(mask));
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        if (key == keys[i]) {
+            return i;
+        }
+    }
+    return count;
+}
+
+  //--------------------------------------------------
+ // EmPersistentId class implementation   
 //--------------------------------------------------
 EmPersistentId::EmPersistentId(char a, char b, char c) {
     uint8_t i = 0;
@@ -369,20 +2642,29 @@ EmPersistentId::EmPersistentId(char a, char b, char c) {
 }
 
 EmPersistentId::EmPersistentId(const char* id) {
-    if (strlen(id) > c_MaxLen) {
-        // ID longer that c_MaxLen chars!
-        m_Id[c_MaxLen] = 0;
-    }
-    for(uint8_t i=0; i < c_MaxLen; i++) {
-        m_Id[i] = strlen(id) > i ? id[i] : 0;
+    const size_t len = strlen(id);
+    if (len > c_MaxLen || 0 != ((uint8_t)id[0] & c_HashedFlag)) {
+        // ID longer that c_MaxLen chars or starting with a non ASCII char 
+        // (i.e. it would read as hashed): store its hash
+        _setHash(FoldHash(Hash(id)));
+        return;
     }
-    m_Id[c_MaxLen] = 0;
+    memset(m_Id, 0, sizeof(m_Id));
+    memcpy(m_Id, id, len);
+}
+
+EmPersistentId::EmPersistentId(const EmPersistentHashedId& id) {
+    _setHash(id.m_FoldedHash);
 }
 
 EmPersistentId::EmPersistentId(const EmPersistentId& id) {
     memcpy(m_Id, id.m_Id, sizeof(m_Id));
 }
 
+bool EmPersistentId::IsValid() const {
+    return *this != EmPersistentState::c_DeletedId && *this != EmPersistentState::c_ErasedId;
+}
+
 char EmPersistentId::operator[](const int index) const
  { 
     if (index >= c_MaxLen) {
@@ -392,6 +2674,17 @@ char EmPersistentId::operator[](const int index) const
     return m_Id[index]; 
 }
 
+void EmPersistentId::_setHash(uint32_t foldedHash) {
+    if (0x7FFFFFUL == foldedHash) {
+        // Avoid the flash erased id (i.e. 0xFFFFFF)
+        foldedHash--;
+    }
+    m_Id[0] = (char)(c_HashedFlag | (uint8_t)(foldedHash >> 16));
+    m_Id[1] = (char)(uint8_t)(foldedHash >> 8);
+    m_Id[2] = (char)(uint8_t)foldedHash;
+    m_Id[c_MaxLen] = 0;
+}
+
 bool EmPersistentId::_store(const EmPersistentState& ps, ps_address_t index) const {
     return ps._updateBytes(index, (const uint8_t*)m_Id, c_MaxLen);
 }
@@ -404,20 +2697,32 @@ bool EmPersistentId::_read(const EmPersistentState& ps, ps_address_t index) {
   //--------------------------------------------------
  // EmPersistentValueBase class implementation   
 //--------------------------------------------------
-EmPersistentValueBase::EmPersistentValueBase(const EmPersistentState& ps,
-                                             const char* id,
+EmPersistentValueBase::EmPersistentValueBase(EmPersistentState& ps,
+                                             const EmPersistentId& id,
                                              ps_address_t address,
                                              ps_size_t bufferSize,
                                              void* pInitValue) 
  : m_Ps(ps),
-   m_Id(EmPersistentId(id)),
+   m_Id(id),
    m_Address(address),
    m_BufferSize(bufferSize),
    m_pValue(pInitValue) {
+#ifndef EM_PS_STATIC_ONLY
+    if (NULL == m_pValue) {
+        m_pValue = EmPersistentAllocator::Alloc(m_BufferSize);
+        if (NULL == m_pValue) {
+            // Allocation failed: leave an empty value which will never be stored
+            m_BufferSize = 0;
+        } else {
+            memset(m_pValue, 0, m_BufferSize);
+        }
+    }
+#else
     if (NULL == m_pValue) {
-        m_pValue = malloc(m_BufferSize);
-        memset(m_pValue, 0, m_BufferSize);
+        // Inline buffer not provided: leave an empty value which will never be stored
+        m_BufferSize = 0;
     }
+#endif
 }
 
 bool EmPersistentValueBase::_store() const
@@ -427,9 +2732,97 @@ bool EmPersistentValueBase::_store() const
         return false;
     }
     // Write the size
-    if (!m_Ps._updateBytes(_sizeAddress(), (const uint8_t*)&m_BufferSize, sizeof(m_BufferSize))) {
+    if (!m_Ps._updateSize(_sizeAddress(), m_BufferSize)) {
         return false;
     }
     // Write the value itself
-    return _updateValue();
+    return _writeValue();
+}
+
+  //--------------------------------------------------
+ // EmPersistentValueRegistry class implementation   
+//--------------------------------------------------
+bool EmPersistentValueRegistry::IsSorted() const {
+    for (uint16_t i=1; i < m_Count; i++) {
+        if (m_pValues[i]->Compare(m_pValues[i-1]->Id(), m_pValues[i-1]->Size()) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+EmPersistentValueBase* EmPersistentValueRegistry::Find(const EmPersistentId& id, 
+                                                       ps_size_t size,
+                                                       bool sorted) const {
+    if (!sorted) {
+        for (uint16_t i=0; i < m_Count; i++) {
+            if (0 == m_pValues[i]->Compare(id, size)) {
+                return m_pValues[i];
+            }
+        }
+        return NULL;
+    }
+    // Binary search the first matching value
+    uint16_t low = 0;
+    uint16_t high = m_Count;
+    while (low < high) {
+        const uint16_t mid = (uint16_t)(low + (high - low) / 2);
+        if (m_pValues[mid]->Compare(id, size) < 0) {
+            low = (uint16_t)(mid + 1);
+        } else {
+            high = mid;
+        }
+    }
+    if (low < m_Count && 0 == m_pValues[low]->Compare(id, size)) {
+        return m_pValues[low];
+    }
+    return NULL;
+}
+
+bool EmPersistentValueRegistry::HasCollisions(const EmLog& log) const {
+    // Same hashed ID and size (i.e. plain IDs or other sizes are distinct records),
+    // a sorted registry has them side by side
+    const bool sorted = IsSorted();
+    bool collisions = false;
+    for (uint16_t i=0; i < m_Count; i++) {
+        const EmPersistentValueBase* pValue = m_pValues[i];
+        if (!pValue->Id().IsHashed()) {
+            continue;
+        }
+        for (uint16_t j=(uint16_t)(i+1); j < m_Count; j++) {
+            const EmPersistentValueBase* pOther = m_pValues[j];
+            if (pOther != pValue && 0 == pOther->Compare(pValue->Id(), pValue->Size())) {
+                log.LogWarning<40>("Value ID collision: %06lX", 
+                                   (unsigned long)pValue->Id().OrderKey());
+                collisions = true;
+            }
+            if (sorted) {
+                break;
+            }
+        }
+    }
+    return collisions;
+}
+
+void EmPersistentValueRegistry::Sort(EmPersistentValueBase* values[], uint16_t count) {
+    // Insertion sort: registries are small and often almost sorted
+    for (uint16_t i=1; i < count; i++) {
+        EmPersistentValueBase* pValue = values[i];
+        uint16_t j = i;
+        while (j > 0 && values[j-1]->Compare(pValue->Id(), pValue->Size()) > 0) {
+            values[j] = values[j-1];
+            j--;
+        }
+        values[j] = pValue;
+    }
+}
+
+  //--------------------------------------------------
+ // EmPersistentValueView class implementation   
+//--------------------------------------------------
+bool EmPersistentValueView::Read(void* pValue, ps_size_t size) const {
+    if (NULL == m_pPs || size < m_Size) {
+        return false;
+    }
+    return m_pPs->_readBytes(_valueAddress(), (uint8_t*)pValue, m_Size);
 }